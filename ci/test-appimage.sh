@@ -3,6 +3,8 @@
 set -x
 # important to allow for checking the exit code of timeout
 set +e
+# pipelines fail if any of their commands fails
+set -o pipefail
 
 TIMEOUT=3
 ARCH="${ARCH:-"$(uname -m)"}"
@@ -17,15 +19,15 @@ if [[ "$1" == "" ]] || [[ ! -x "$1" ]]; then
     exit 2
 fi
 
-appimagetool="$1"
+appimagetool="$(readlink -f "$1")"
 
-if [[ "$PATCH_OUT_MAGIC_BYTES" != "" ]]; then
-    tmpdir="$(mktemp -d /tmp/appimage-test-XXXXX)"
-    cleanup() {
-        [[ -d "$tmpdir" ]] && rm -r "$tmpdir"
-    }
-    trap cleanup EXIT
+tmpdir="$(mktemp -d /tmp/appimage-test-XXXXX)"
+cleanup() {
+    [[ -d "$tmpdir" ]] && rm -r "$tmpdir"
+}
+trap cleanup EXIT
 
+if [[ "$PATCH_OUT_MAGIC_BYTES" != "" ]]; then
     echo "Copying appimagetool and patching out magic bytes"
     cp "$appimagetool" "$tmpdir/"
     ls -al "$tmpdir"
@@ -42,5 +44,31 @@ fi
 "$appimagetool" --appimage-version || error  # should not fail
 "$appimagetool" --appimage-updateinformation || error  # should not fail
 
+# read the embedded filesystem image in the various ways the runtime offers, the results must agree
+workdir="$tmpdir"/runtime-test
+mkdir "$workdir" || error
+pushd "$workdir" || error
+
+"$appimagetool" --appimage-extract > /dev/null || error
+(cd squashfs-root && find . -mindepth 1 | sed 's|^\./||' | sort) > extracted.txt || error
+
+# --appimage-extract-tar must archive the same entries
+"$appimagetool" --appimage-extract-tar > contents.tar || error
+tar tf contents.tar | sed 's|/$||' | sort > archived.txt || error
+diff -u extracted.txt archived.txt || error
+
+# --appimage-cat must print files byte for byte
+regular_file="$(cd squashfs-root && find . -mindepth 2 -type f | sed 's|^\./||' | sort | head -n1)"
+[[ "$regular_file" != "" ]] || error
+"$appimagetool" --appimage-cat "$regular_file" > cat.out || error
+cmp squashfs-root/"$regular_file" cat.out || error
+
+# --appimage-list must only list the entries matching the patterns in the file
+printf '%s\n' AppRun "$regular_file" > patterns.txt
+"$appimagetool" --appimage-list @patterns.txt | sed -E 's/^[^ ]+ +[0-9]+ //; s/ -> .*$//' | sort > listed.txt || error
+sort -u patterns.txt | diff -u - listed.txt || error
+
+popd || error
+
 echo "" >&2
 echo "Tests successful!" >&2
@@ -1,4 +1,7 @@
 set(APPIMAGEKIT_RUNTIME_ENABLE_SETPROCTITLE OFF CACHE BOOL "Useful for $TARGET_APPIMAGE; see issue #763")
+# requires the build system's kernel headers to ship linux/io_uring.h (Linux 5.6+); the runtime falls back to regular
+# syscalls when the kernel it runs on lacks io_uring support
+set(APPIMAGEKIT_RUNTIME_ENABLE_IO_URING OFF CACHE BOOL "Use io_uring to write small files when extracting AppImages")
 
 # if set to anything but ON, the magic bytes won't be embedded
 # CAUTION: the magic bytes are a hard requirement for type 2 AppImages! This option should NEVER be used unless you are
@@ -50,6 +53,10 @@ if(APPIMAGEKIT_RUNTIME_ENABLE_SETPROCTITLE)
     set(runtime_cflags ${runtime_cflags} -DENABLE_SETPROCTITLE)
 endif()
 
+if(APPIMAGEKIT_RUNTIME_ENABLE_IO_URING)
+    set(runtime_cflags ${runtime_cflags} -DENABLE_IO_URING)
+endif()
+
 # objcopy requires actual files for creating new sections to populate the new section
 # therefore, we generate 3 suitable files containing blank bytes in the right sizes
 add_custom_command(
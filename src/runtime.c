@@ -38,7 +38,13 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/file.h>
+#include <sys/syscall.h>
+#include <sys/statvfs.h>
+#include <sys/resource.h>
+#include <sys/sysmacros.h>
 #include <ftw.h>
+#include <dirent.h>
 #include <stdio.h>
 #include <signal.h>
 #include <string.h>
@@ -47,6 +53,13 @@
 #include <errno.h>
 #include <wait.h>
 #include <fnmatch.h>
+#include <time.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+
+#ifdef ENABLE_IO_URING
+#include <linux/io_uring.h>
+#endif
 
 #include <appimage/appimage_shared.h>
 #include <hashlib.h>
@@ -128,11 +141,100 @@ sqfs_err private_sqfs_stat(sqfs *fs, sqfs_inode *inode, struct stat *st) {
 
 /* ================= End ELF parsing */
 
+uint64_t monotonic_time_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+/* Launch tracing, enabled by setting $APPIMAGE_TRACE to a file name (appended to) or to "fd:<n>"
+ *
+ * Every phase is written as one line of JSON:
+ * {"launch":<pid>,"pid":<pid>,"process":"runtime","phase":"elf_size","start_ns":<t>,"duration_ns":<t>}
+ * Timestamps are taken from CLOCK_MONOTONIC, so the records of the runtime and its FUSE process can be
+ * put on one timeline. Each record is written with a single write() on an O_APPEND file, hence several
+ * processes and launches can share the same trace file without their records interleaving.
+ */
+static int trace_fd = -1;
+static pid_t trace_launch_pid;
+static const char* trace_process = "runtime";
+
+void trace_init(void) {
+    const char* const value = getenv("APPIMAGE_TRACE");
+    if (value == NULL || *value == '\0')
+        return;
+
+    if (strncmp(value, "fd:", 3) == 0) {
+        char* end;
+        long fd = strtol(value + 3, &end, 10);
+        if (*end != '\0' || end == value + 3 || fd < 0 || fcntl((int) fd, F_GETFD) == -1) {
+            fprintf(stderr, "Ignoring APPIMAGE_TRACE, %s is not an open file descriptor\n", value + 3);
+            return;
+        }
+        trace_fd = (int) fd;
+    } else {
+        // the trace file must not leak into the application
+        trace_fd = open(value, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (trace_fd == -1) {
+            fprintf(stderr, "Failed to open trace file %s: %s\n", value, strerror(errno));
+            return;
+        }
+    }
+
+    trace_launch_pid = getpid();
+}
+
+void trace_phase(const char* phase, uint64_t start_ns, uint64_t end_ns) {
+    if (trace_fd == -1)
+        return;
+
+    // stdio buffers would be duplicated by fork(), format the record on the stack instead
+    char record[256];
+    int length = snprintf(record, sizeof(record),
+                          "{\"launch\":%d,\"pid\":%d,\"process\":\"%s\",\"phase\":\"%s\","
+                          "\"start_ns\":%" PRIu64 ",\"duration_ns\":%" PRIu64 "}\n",
+                          (int) trace_launch_pid, (int) getpid(), trace_process, phase, start_ns, end_ns - start_ns);
+    if (length <= 0 || length >= (int) sizeof(record))
+        return;
+
+    if (write(trace_fd, record, length) != length) {
+        // don't let a full disk or closed pipe slow down every further phase
+        trace_fd = -1;
+    }
+}
+
 extern int fusefs_main(int argc, char *argv[], void (*mounted) (void));
 // extern void ext2_quit(void);
 
 static pid_t fuse_pid;
 static int keepalive_pipe[2];
+static uint64_t fuse_start_ns;
+
+/* A mount shared by all instances of the same AppImage run by the same user, see shared_mount_open */
+struct shared_mount {
+    char mount_dir[PATH_MAX];
+    // serializes mounting, joining and unmounting
+    char lock_path[PATH_MAX];
+    // every instance holds a shared lock on this file for as long as it (or any process it started) runs
+    char users_path[PATH_MAX];
+    int lock_fd;
+    int users_fd;
+    unsigned int idle_timeout;
+};
+
+// set in the FUSE process if it serves a shared mount
+static struct shared_mount* fuse_shared_mount;
+
+/* Profile-guided prefetching of the image, see prefetch_init */
+#define PREFETCH_PROFILE_SECONDS 10
+
+struct prefetch {
+    char image_path[PATH_MAX];
+    char profile_path[PATH_MAX];
+};
+
+// set in the FUSE process if prefetching is enabled
+static struct prefetch* fuse_prefetch;
 
 static void *
 write_pipe_thread (void *arg)
@@ -152,11 +254,165 @@ write_pipe_thread (void *arg)
     return NULL;
 }
 
+/* Unmount a shared mount once nobody has been using it for its idle timeout
+ * The users lock can only be locked exclusively if no instance is running any more. Instances only join while holding
+ * the mount lock, which is kept from the moment the FUSE process decides to exit until it has exited. */
+static void *
+shared_mount_idle_thread (void *arg)
+{
+    struct shared_mount* shared = arg;
+
+    int lock_fd = open(shared->lock_path, O_RDWR | O_CLOEXEC);
+    int users_fd = open(shared->users_path, O_RDWR | O_CLOEXEC);
+    if (lock_fd == -1 || users_fd == -1) {
+        // better to keep the mount around than to pull it from under a running application
+        return NULL;
+    }
+
+    uint64_t idle_since = 0;
+    for (;;) {
+        sleep(1);
+
+        if (flock(lock_fd, LOCK_EX) == -1)
+            continue;
+
+        if (flock(users_fd, LOCK_EX | LOCK_NB) == 0) {
+            flock(users_fd, LOCK_UN);
+
+            const uint64_t now = monotonic_time_ns();
+            if (idle_since == 0)
+                idle_since = now;
+
+            if (now - idle_since >= (uint64_t) shared->idle_timeout * 1000000000) {
+                // the mount lock is released when this process exits, i.e., after unmounting
+                kill(fuse_pid, SIGTERM);
+                return NULL;
+            }
+        } else {
+            idle_since = 0;
+        }
+
+        flock(lock_fd, LOCK_UN);
+    }
+}
+
+/* Issue readahead for all ranges of the image listed in the profile, returns false if there is no profile */
+bool prefetch_from_profile(const struct prefetch* const prefetch, const int fd) {
+    FILE* profile = fopen(prefetch->profile_path, "re");
+    if (profile == NULL)
+        return false;
+
+    const uint64_t start = monotonic_time_ns();
+
+    unsigned long long offset;
+    unsigned long long length;
+    while (fscanf(profile, "%llu %llu", &offset, &length) == 2) {
+        // only starts reading, the data is served from the page cache once the application asks for it
+        posix_fadvise(fd, (off_t) offset, (off_t) length, POSIX_FADV_WILLNEED);
+    }
+
+    fclose(profile);
+    trace_phase("prefetch", start, monotonic_time_ns());
+    return true;
+}
+
+/* Record which pages of the image are read within the first PREFETCH_PROFILE_SECONDS after mounting
+ * mincore(2) reports which pages of the image are in the page cache; those which weren't right after mounting are the
+ * ones the application needed to start up. Linux only reports this for files the user owns or may write to. */
+void prefetch_record_profile(const struct prefetch* const prefetch, const int fd) {
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size == 0)
+        return;
+
+    const size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    const size_t pages = ((size_t) st.st_size + page_size - 1) / page_size;
+
+    void* map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        return;
+
+    unsigned char* before = malloc(pages);
+    unsigned char* after = malloc(pages);
+
+    if (before != NULL && after != NULL && mincore(map, (size_t) st.st_size, before) == 0) {
+        sleep(PREFETCH_PROFILE_SECONDS);
+
+        if (mincore(map, (size_t) st.st_size, after) == 0) {
+            // concurrent launches might record a profile at the same time, the last one wins
+            char temp_path[PATH_MAX + 16];
+            snprintf(temp_path, sizeof(temp_path), "%s.%d", prefetch->profile_path, (int) getpid());
+
+            FILE* profile = fopen(temp_path, "we");
+            if (profile != NULL) {
+                size_t ranges = 0;
+
+                for (size_t i = 0; i < pages;) {
+                    if (!(after[i] & 1) || (before[i] & 1)) {
+                        i++;
+                        continue;
+                    }
+
+                    size_t first = i;
+                    while (i < pages && (after[i] & 1) && !(before[i] & 1))
+                        i++;
+
+                    fprintf(profile, "%llu %llu\n", (unsigned long long) first * page_size,
+                            (unsigned long long) (i - first) * page_size);
+                    ranges++;
+                }
+
+                // an empty profile would keep a profile from being recorded by a later launch
+                if (fclose(profile) == 0 && ranges > 0)
+                    rename(temp_path, prefetch->profile_path);
+                else
+                    unlink(temp_path);
+            }
+        }
+    }
+
+    free(before);
+    free(after);
+    munmap(map, (size_t) st.st_size);
+}
+
+static void *
+prefetch_thread (void *arg)
+{
+    struct prefetch* prefetch = arg;
+
+    int fd = open(prefetch->image_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return NULL;
+
+    if (!prefetch_from_profile(prefetch, fd))
+        prefetch_record_profile(prefetch, fd);
+
+    close(fd);
+    return NULL;
+}
+
 void
 fuse_mounted (void)
 {
     pthread_t thread;
     fuse_pid = getpid();
+    trace_phase("mount", fuse_start_ns, monotonic_time_ns());
+
+    if (fuse_prefetch != NULL) {
+        pthread_t prefetch;
+        if (pthread_create(&prefetch, NULL, prefetch_thread, fuse_prefetch) == 0)
+            pthread_detach(prefetch);
+    }
+
+    if (fuse_shared_mount != NULL) {
+        // the lifetime of a shared mount is not tied to the instance which mounted it, just signal it is ready
+        char c = 'x';
+        write(keepalive_pipe[1], &c, 1);
+        close(keepalive_pipe[1]);
+        pthread_create(&thread, NULL, shared_mount_idle_thread, fuse_shared_mount);
+        return;
+    }
+
     pthread_create(&thread, NULL, write_pipe_thread, keepalive_pipe);
 }
 
@@ -211,15 +467,59 @@ mkdir_p(const char* const path)
     return 0;
 }
 
+/* Open (creating it if necessary) and flock(2) a lock file
+ * Lock files may be unlinked by whoever holds an exclusive lock on them, therefore the lock is retried until it is
+ * held on the file which is actually found at path
+ * Returns the fd holding the lock, or -1 on errors (e.g., if operation contains LOCK_NB and the file is locked) */
+int lock_file(const char* const path, const int operation) {
+    for (;;) {
+        int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (fd == -1)
+            return -1;
+
+        while (flock(fd, operation) == -1) {
+            if (errno != EINTR) {
+                int error = errno;
+                close(fd);
+                errno = error;
+                return -1;
+            }
+        }
+
+        struct stat fd_stat;
+        struct stat path_stat;
+        if (fstat(fd, &fd_stat) == 0 && stat(path, &path_stat) == 0 &&
+            fd_stat.st_dev == path_stat.st_dev && fd_stat.st_ino == path_stat.st_ino) {
+            return fd;
+        }
+
+        close(fd);
+    }
+}
+
 void
 print_help(const char *appimage_path)
 {
-    // TODO: "--appimage-list                 List content from embedded filesystem image\n"
     fprintf(stderr,
         "AppImage options:\n\n"
-        "  --appimage-extract [<pattern>]  Extract content from embedded filesystem image\n"
-        "                                  If pattern is passed, only extract matching files\n"
+        "  --appimage-cat <path>           Write file from embedded filesystem image to\n"
+        "                                  stdout\n"
+        "  --appimage-extract [<pattern>...]\n"
+        "                                  Extract content from embedded filesystem image\n"
+        "                                  If patterns are passed, only extract matching files\n"
+        "  --appimage-extract @<file>      Extract files matching the patterns listed in\n"
+        "                                  file, one per line\n"
+        "  --appimage-extract-stats [<pattern>...]\n"
+        "                                  Like --appimage-extract, but print statistics\n"
+        "                                  about the extraction to stderr as JSON\n"
+        "  --appimage-extract-tar [<pattern>...]\n"
+        "                                  Write content from embedded filesystem image to\n"
+        "                                  stdout as a tar archive, accepts the same\n"
+        "                                  patterns as --appimage-extract\n"
         "  --appimage-help                 Print this help\n"
+        "  --appimage-list [--json] [--compressed-size] [<pattern>...|@<file>]\n"
+        "                                  List content from embedded filesystem image,\n"
+        "                                  as JSON lines if --json is passed\n"
         "  --appimage-mount                Mount embedded filesystem image and print\n"
         "                                  mount point and wait for kill with Ctrl-C\n"
         "  --appimage-offset               Print byte offset to start of embedded\n"
@@ -274,275 +574,4363 @@ portable_option(const char *arg, const char *appimage_path, const char *name)
     }
 }
 
-bool extract_appimage(const char* const appimage_path, const char* const _prefix, const char* const _pattern, const bool overwrite, const bool verbose) {
-    sqfs_err err = SQFS_OK;
-    sqfs_traverse trv;
-    sqfs fs;
-    char prefixed_path_to_extract[1024];
+/* Decompressed fragment blocks, shared by all threads extracting an AppImage
+ * Every extraction worker reads the image through its own sqfs, whose caches are small and not thread-safe, so a
+ * fragment needed by files which are extracted by different workers (or far apart) would be decompressed again every
+ * time. This cache keeps copies of fragments until the memory budget taken from $APPIMAGE_CACHE_MB is used up.
+ * It is split into shards by fragment index, each with its own lock, so that workers rarely wait for each other.
+ * Within a shard, entries are evicted using the CLOCK algorithm: an entry is only spared if it has been used again since
+ * the clock hand last passed it, hence a run of fragments which are needed only once can't push out those needed again. */
+#define BLOCK_CACHE_SHARDS 16
+#define BLOCK_CACHE_DEFAULT_MB 32
+
+struct cached_block {
+    uint32_t fragment;
+    // held by the cache while the block is in it, and by every stream using it
+    size_t refs;
+    bool referenced;
+    size_t size;
+    char* data;
+};
 
-    // local copy we can modify safely
-    // allocate 1 more byte than we would need so we can add a trailing slash if there is none yet
-    char* prefix = malloc(strlen(_prefix) + 2);
-    strcpy(prefix, _prefix);
+struct block_cache_shard {
+    pthread_mutex_t mutex;
+    struct cached_block** entries;
+    size_t count;
+    size_t capacity;
+    size_t hand;
+    size_t bytes;
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+};
 
-    // sanitize prefix
-    if (prefix[strlen(prefix) - 1] != '/')
-        strcat(prefix, "/");
+struct block_cache {
+    struct block_cache_shard shards[BLOCK_CACHE_SHARDS];
+    size_t shard_budget;
+};
 
-    if (access(prefix, F_OK) == -1) {
-        if (mkdir_p(prefix) == -1) {
-            perror("mkdir_p error");
+/* Memory budget of the block cache in bytes, taken from $APPIMAGE_CACHE_MB, 0 disables the cache */
+size_t block_cache_budget_from_env(void) {
+    unsigned long long max_mb = BLOCK_CACHE_DEFAULT_MB;
+
+    const char* const value = getenv("APPIMAGE_CACHE_MB");
+    if (value != NULL && *value != '\0') {
+        char* end;
+        unsigned long long parsed = strtoull(value, &end, 10);
+        if (*end != '\0' || parsed > SIZE_MAX / (1024 * 1024)) {
+            fprintf(stderr, "Invalid value for $APPIMAGE_CACHE_MB: %s, using default\n", value);
+        } else {
+            max_mb = parsed;
+        }
+    }
+
+    return (size_t) max_mb * 1024 * 1024;
+}
+
+void block_cache_init(struct block_cache* cache, const size_t budget) {
+    memset(cache, 0, sizeof(*cache));
+    cache->shard_budget = budget / BLOCK_CACHE_SHARDS;
+
+    for (size_t i = 0; i < BLOCK_CACHE_SHARDS; i++)
+        pthread_mutex_init(&cache->shards[i].mutex, NULL);
+}
+
+/* Drop a reference to a block, freeing it along with the last one; the block's shard must be locked */
+void cached_block_unref(struct cached_block* block) {
+    if (--block->refs == 0) {
+        free(block->data);
+        free(block);
+    }
+}
+
+void block_cache_free(struct block_cache* cache) {
+    for (size_t i = 0; i < BLOCK_CACHE_SHARDS; i++) {
+        struct block_cache_shard* shard = &cache->shards[i];
+        for (size_t j = 0; j < shard->count; j++)
+            cached_block_unref(shard->entries[j]);
+        free(shard->entries);
+        pthread_mutex_destroy(&shard->mutex);
+    }
+}
+
+struct cached_block* block_cache_find(struct block_cache_shard* shard, const uint32_t fragment) {
+    for (size_t i = 0; i < shard->count; i++) {
+        if (shard->entries[i]->fragment == fragment)
+            return shard->entries[i];
+    }
+    return NULL;
+}
+
+/* Evict entries from a locked shard until size more bytes fit into its budget
+ * Returns false if they can't be made to fit, e.g., because the remaining entries are being used */
+bool block_cache_make_room(struct block_cache* cache, struct block_cache_shard* shard, const size_t size) {
+    if (size > cache->shard_budget)
+        return false;
+
+    size_t spared = 0;
+    while (shard->bytes + size > cache->shard_budget) {
+        // every entry has been passed twice, i.e., all of them are in use
+        if (spared > 2 * shard->count)
+            return false;
+
+        if (shard->hand >= shard->count)
+            shard->hand = 0;
+
+        struct cached_block* entry = shard->entries[shard->hand];
+        if (entry->referenced || entry->refs > 1) {
+            entry->referenced = false;
+            shard->hand++;
+            spared++;
+            continue;
+        }
+
+        shard->bytes -= entry->size;
+        shard->evictions++;
+        cached_block_unref(entry);
+
+        // the last entry takes the evicted one's place, the hand hasn't passed it yet
+        shard->entries[shard->hand] = shard->entries[--shard->count];
+    }
+
+    if (shard->count == shard->capacity) {
+        size_t capacity = shard->capacity == 0 ? 8 : shard->capacity * 2;
+        struct cached_block** entries = realloc(shard->entries, capacity * sizeof(struct cached_block*));
+        if (entries == NULL)
+            return false;
+        shard->entries = entries;
+        shard->capacity = capacity;
+    }
+
+    return true;
+}
+
+/* Look up the fragment block of a regular file inode, decompressing (and caching) it if necessary
+ * The block must be released with block_cache_release once it is no longer needed, returns NULL on errors */
+struct cached_block* block_cache_get_fragment(struct block_cache* cache, sqfs* fs, sqfs_inode* inode, sqfs_err* err) {
+    const uint32_t fragment = inode->xtra.reg.frag_idx;
+    struct block_cache_shard* shard = &cache->shards[fragment % BLOCK_CACHE_SHARDS];
+
+    pthread_mutex_lock(&shard->mutex);
+    struct cached_block* cached = block_cache_find(shard, fragment);
+    if (cached != NULL) {
+        cached->refs++;
+        cached->referenced = true;
+        shard->hits++;
+    } else {
+        shard->misses++;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+
+    if (cached != NULL)
+        return cached;
+
+    // decompress without holding the lock, through the worker's own sqfs
+    sqfs_block* block;
+    size_t offset;
+    size_t size;
+    if ((*err = sqfs_frag_block(fs, inode, &offset, &size, &block)))
+        return NULL;
+
+    cached = malloc(sizeof(struct cached_block));
+    if (cached == NULL || (cached->data = malloc(block->size)) == NULL) {
+        free(cached);
+        *err = SQFS_ERR;
+        return NULL;
+    }
+
+    memcpy(cached->data, block->data, block->size);
+    cached->fragment = fragment;
+    cached->size = block->size;
+    cached->refs = 1;
+    cached->referenced = false;
+
+    pthread_mutex_lock(&shard->mutex);
+    // another worker might have decompressed the same fragment in the meantime, if so, this copy is used only once
+    if (block_cache_find(shard, fragment) == NULL && block_cache_make_room(cache, shard, cached->size)) {
+        cached->refs++;
+        shard->entries[shard->count++] = cached;
+        shard->bytes += cached->size;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+
+    return cached;
+}
+
+void block_cache_release(struct block_cache* cache, struct cached_block* block) {
+    struct block_cache_shard* shard = &cache->shards[block->fragment % BLOCK_CACHE_SHARDS];
+
+    pthread_mutex_lock(&shard->mutex);
+    cached_block_unref(block);
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+/* Sum up the counters of all shards, which must not be in use any more */
+void block_cache_counters(const struct block_cache* cache, size_t* hits, size_t* misses, size_t* evictions) {
+    *hits = *misses = *evictions = 0;
+
+    for (size_t i = 0; i < BLOCK_CACHE_SHARDS; i++) {
+        *hits += cache->shards[i].hits;
+        *misses += cache->shards[i].misses;
+        *evictions += cache->shards[i].evictions;
+    }
+}
+
+/* Streams the contents of a regular file inode one whole data block at a time, in file order
+ * Unlike sqfs_read_range, which is called with arbitrary ranges and has to look up (and possibly decompress) the
+ * block containing the start of the range every time, every block is read and decompressed exactly once
+ * Data blocks bypass the data cache since they're not going to be needed again, the fragment block (if any) is shared
+ * between files and therefore looked up through the fragment cache (or the shared fragment_cache, if set) */
+struct file_block_stream {
+    sqfs* fs;
+    sqfs_inode* inode;
+    sqfs_blocklist blocklist;
+    // block returned by the last call to file_block_stream_next, if it is owned by the stream
+    sqfs_block* block;
+    bool fragment_done;
+    // if set, fragments are taken from this cache instead of the sqfs' own one
+    struct block_cache* fragment_cache;
+    struct cached_block* cached_fragment;
+    // if set, blocks stored uncompressed are not read, but returned as a range of the image file for the caller to copy
+    bool passthrough;
+    // offset in the image file of the block returned by the last call to file_block_stream_next if it is to be copied by
+    // the caller, -1 otherwise
+    off_t passthrough_offset;
+    // size of the block returned by the last call to file_block_stream_next as stored in the image, 0 for sparse blocks
+    // and fragments
+    size_t stored_size;
+};
+
+void file_block_stream_init(struct file_block_stream* stream, sqfs* fs, sqfs_inode* inode) {
+    memset(stream, 0, sizeof(*stream));
+    stream->fs = fs;
+    stream->inode = inode;
+    stream->passthrough_offset = -1;
+    sqfs_blocklist_init(fs, inode, &stream->blocklist);
+}
+
+void file_block_stream_close(struct file_block_stream* stream) {
+    if (stream->block != NULL) {
+        sqfs_block_dispose(stream->block);
+        stream->block = NULL;
+    }
+    if (stream->cached_fragment != NULL) {
+        block_cache_release(stream->fragment_cache, stream->cached_fragment);
+        stream->cached_fragment = NULL;
+    }
+}
+
+/* Fetch the next block of the file
+ * Returns false once the end of the file has been reached or an error occurred, check err to tell these apart
+ * The data pointed to by *data is valid until the next call
+ * For sparse blocks (i.e., holes in the file), *data is set to NULL, and *size to the length of the hole
+ * The same goes for blocks which are passed through, which can be told apart by stream->passthrough_offset */
+bool file_block_stream_next(struct file_block_stream* stream, const void** data, size_t* size, sqfs_err* err) {
+    sqfs* fs = stream->fs;
+    sqfs_inode* inode = stream->inode;
+
+    *err = SQFS_OK;
+    stream->passthrough_offset = -1;
+    stream->stored_size = 0;
+
+    file_block_stream_close(stream);
+
+    if (stream->blocklist.remain > 0) {
+        if ((*err = sqfs_blocklist_next(&stream->blocklist)))
+            return false;
+
+        if (stream->blocklist.input_size == 0) {
+            // sparse block, i.e., a hole in the file
+            uint64_t remaining = inode->xtra.reg.file_size - stream->blocklist.pos;
+            *data = NULL;
+            *size = remaining < fs->sb.block_size ? (size_t) remaining : fs->sb.block_size;
+            return true;
+        }
+
+        if (stream->passthrough) {
+            // mksquashfs stores blocks uncompressed if compressing them doesn't save space, e.g., for media files
+            bool compressed;
+            uint32_t stored_size;
+            sqfs_data_header(stream->blocklist.header, &compressed, &stored_size);
+
+            if (!compressed) {
+                *data = NULL;
+                *size = stored_size;
+                stream->passthrough_offset = (off_t) (fs_offset + stream->blocklist.block);
+                stream->stored_size = stored_size;
+                return true;
+            }
+        }
+
+        if ((*err = sqfs_data_block_read(fs, (sqfs_off_t) stream->blocklist.block, stream->blocklist.header, &stream->block)))
+            return false;
+
+        stream->stored_size = stream->blocklist.input_size;
+
+        *data = stream->block->data;
+        *size = stream->block->size;
+        return true;
+    }
+
+    if (!stream->fragment_done && inode->xtra.reg.frag_idx != SQUASHFS_INVALID_FRAG) {
+        stream->fragment_done = true;
+
+        if (stream->fragment_cache != NULL) {
+            stream->cached_fragment = block_cache_get_fragment(stream->fragment_cache, fs, inode, err);
+            if (stream->cached_fragment == NULL)
+                return false;
+
+            *data = stream->cached_fragment->data + inode->xtra.reg.frag_off;
+            *size = inode->xtra.reg.file_size % fs->sb.block_size;
+            return true;
+        }
+
+        sqfs_block* fragment;
+        size_t offset;
+        if ((*err = sqfs_frag_block(fs, inode, &offset, size, &fragment)))
+            return false;
+
+        *data = (char*) fragment->data + offset;
+        return true;
+    }
+
+    return false;
+}
+
+/* Count the bytes of a file which are stored as sparse blocks, i.e., need not be written when extracting it
+ * Only walks the file's block list, nothing is decompressed */
+bool file_sparse_bytes(sqfs* fs, sqfs_inode* inode, uint64_t* sparse_bytes) {
+    *sparse_bytes = 0;
+
+    sqfs_blocklist blocklist;
+    sqfs_blocklist_init(fs, inode, &blocklist);
+
+    while (blocklist.remain > 0) {
+        if (sqfs_blocklist_next(&blocklist))
+            return false;
+
+        if (blocklist.input_size == 0) {
+            uint64_t remaining = inode->xtra.reg.file_size - blocklist.pos;
+            *sparse_bytes += remaining < fs->sb.block_size ? remaining : fs->sb.block_size;
+        }
+    }
+
+    return true;
+}
+
+/* Number of threads used to extract regular files, taken from $APPIMAGE_EXTRACT_THREADS
+ * 1 (the default) extracts everything in the calling thread, 0 uses one thread per online CPU */
+int extract_threads_from_env(void) {
+    const int max_threads = 64;
+
+    const char* const value = getenv("APPIMAGE_EXTRACT_THREADS");
+    if (value == NULL || *value == '\0')
+        return 1;
+
+    char* end;
+    long threads = strtol(value, &end, 10);
+    if (*end != '\0' || threads < 0) {
+        fprintf(stderr, "Invalid value for $APPIMAGE_EXTRACT_THREADS: %s, using a single thread\n", value);
+        return 1;
+    }
+
+    if (threads == 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (threads < 1)
+        threads = 1;
+    if (threads > max_threads)
+        threads = max_threads;
+
+    return (int) threads;
+}
+
+/* Simple arena for strings which are all freed at once, which saves a malloc (and its overhead) per extracted file */
+struct string_arena_chunk {
+    struct string_arena_chunk* next;
+    size_t used;
+    size_t size;
+    char data[];
+};
+
+struct string_arena {
+    struct string_arena_chunk* head;
+};
+
+char* string_arena_strdup(struct string_arena* arena, const char* const str) {
+    const size_t default_chunk_size = 64 * 1024;
+
+    const size_t length = strlen(str) + 1;
+    struct string_arena_chunk* chunk = arena->head;
+
+    if (chunk == NULL || chunk->size - chunk->used < length) {
+        size_t size = length > default_chunk_size ? length : default_chunk_size;
+        chunk = malloc(sizeof(struct string_arena_chunk) + size);
+        if (chunk == NULL)
+            return NULL;
+        chunk->next = arena->head;
+        chunk->used = 0;
+        chunk->size = size;
+        arena->head = chunk;
+    }
+
+    char* copy = chunk->data + chunk->used;
+    memcpy(copy, str, length);
+    chunk->used += length;
+    return copy;
+}
+
+void string_arena_free(struct string_arena* arena) {
+    while (arena->head != NULL) {
+        struct string_arena_chunk* next = arena->head->next;
+        free(arena->head);
+        arena->head = next;
+    }
+}
+
+/* Open addressing hash map from inode number to the path the inode has been extracted to
+ * Only inodes with more than one link are ever looked up again, therefore only those are stored, and the memory used
+ * scales with the number of hardlinks rather than the number of inodes in the image */
+struct hardlink_map_entry {
+    sqfs_inode_num inode_number;
+    const char* path;
+};
+
+struct hardlink_map {
+    struct hardlink_map_entry* entries;
+    size_t capacity;
+    size_t count;
+};
+
+static size_t hardlink_map_slot(const struct hardlink_map* map, const sqfs_inode_num inode_number) {
+    // Fibonacci hashing: the high bits of the product are the well mixed ones, capacity is always a power of two
+    const int bits = __builtin_ctzll((unsigned long long) map->capacity);
+    size_t slot = (size_t) (((uint64_t) inode_number * 11400714819323198485ull) >> (64 - bits));
+
+    while (map->entries[slot].path != NULL && map->entries[slot].inode_number != inode_number) {
+        slot = (slot + 1) & (map->capacity - 1);
+    }
+
+    return slot;
+}
+
+const char* hardlink_map_get(const struct hardlink_map* map, const sqfs_inode_num inode_number) {
+    if (map->count == 0)
+        return NULL;
+
+    return map->entries[hardlink_map_slot(map, inode_number)].path;
+}
+
+bool hardlink_map_put(struct hardlink_map* map, const sqfs_inode_num inode_number, const char* const path) {
+    // keep the load factor below 3/4
+    if ((map->count + 1) * 4 > map->capacity * 3) {
+        struct hardlink_map resized;
+        resized.capacity = map->capacity == 0 ? 64 : map->capacity * 2;
+        resized.count = 0;
+        resized.entries = calloc(resized.capacity, sizeof(struct hardlink_map_entry));
+        if (resized.entries == NULL)
             return false;
+
+        for (size_t i = 0; i < map->capacity; i++) {
+            if (map->entries[i].path != NULL)
+                resized.entries[hardlink_map_slot(&resized, map->entries[i].inode_number)] = map->entries[i];
         }
+        resized.count = map->count;
+
+        free(map->entries);
+        *map = resized;
+    }
+
+    size_t slot = hardlink_map_slot(map, inode_number);
+    if (map->entries[slot].path == NULL)
+        map->count++;
+
+    map->entries[slot].inode_number = inode_number;
+    map->entries[slot].path = path;
+    return true;
+}
+
+void hardlink_map_free(struct hardlink_map* map) {
+    free(map->entries);
+    memset(map, 0, sizeof(*map));
+}
+
+/* Set of fnmatch(3) patterns selecting which entries to extract, compiled once before traversing the image
+ * Every pattern is also split into its path components, which allows to tell whether anything inside a directory could
+ * possibly match, so that directories which can't contain any matches don't have to be traversed at all */
+struct extract_pattern {
+    const char* pattern;
+    // copy of the pattern with slashes replaced by null bytes
+    char* components_buffer;
+    char** components;
+    size_t components_count;
+};
+
+struct extract_pattern_set {
+    struct extract_pattern* patterns;
+    size_t count;
+};
+
+/* Compile a NULL-terminated list of patterns */
+bool extract_pattern_set_init(struct extract_pattern_set* set, char* const* const patterns) {
+    memset(set, 0, sizeof(*set));
+
+    while (patterns[set->count] != NULL)
+        set->count++;
+
+    set->patterns = calloc(set->count, sizeof(struct extract_pattern));
+    if (set->patterns == NULL && set->count > 0) {
+        set->count = 0;
+        return false;
     }
 
-    if ((err = sqfs_open_image(&fs, appimage_path, (size_t) fs_offset))) {
-        fprintf(stderr, "Failed to open squashfs image\n");
+    for (size_t i = 0; i < set->count; i++) {
+        struct extract_pattern* pattern = &set->patterns[i];
+        pattern->pattern = patterns[i];
+
+        pattern->components_buffer = strdup(patterns[i]);
+        if (pattern->components_buffer == NULL)
+            return false;
+
+        size_t count = 1;
+        for (const char* p = patterns[i]; *p != '\0'; p++) {
+            if (*p == '/')
+                count++;
+        }
+
+        pattern->components = malloc(count * sizeof(char*));
+        if (pattern->components == NULL)
+            return false;
+
+        char* component = pattern->components_buffer;
+        for (char* p = pattern->components_buffer;; p++) {
+            if (*p == '/' || *p == '\0') {
+                const bool last = *p == '\0';
+                *p = '\0';
+                pattern->components[pattern->components_count++] = component;
+                component = p + 1;
+                if (last)
+                    break;
+            }
+        }
+    }
+
+    return true;
+}
+
+void extract_pattern_set_free(struct extract_pattern_set* set) {
+    for (size_t i = 0; i < set->count; i++) {
+        free(set->patterns[i].components_buffer);
+        free(set->patterns[i].components);
+    }
+    free(set->patterns);
+    memset(set, 0, sizeof(*set));
+}
+
+/* Check whether path (relative to the root of the image) matches any of the patterns */
+bool extract_pattern_set_matches(const struct extract_pattern_set* set, const char* const path) {
+    for (size_t i = 0; i < set->count; i++) {
+        if (fnmatch(set->patterns[i].pattern, path, FNM_FILE_NAME | FNM_LEADING_DIR) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+/* Check whether any of the patterns could match an entry inside the directory dir_path, which itself didn't match
+ * depth is the number of slashes in dir_path */
+bool extract_pattern_set_may_match_below(const struct extract_pattern_set* set, const char* const dir_path, const size_t depth) {
+    for (size_t i = 0; i < set->count; i++) {
+        const struct extract_pattern* pattern = &set->patterns[i];
+
+        // the pattern must have more components than the directory's path, and the leading ones must match it
+        if (pattern->components_count <= depth + 1)
+            continue;
+
+        bool may_match = true;
+        const char* component = dir_path;
+        for (size_t j = 0; may_match && j <= depth; j++) {
+            const char* end = strchr(component, '/');
+            size_t length = end == NULL ? strlen(component) : (size_t) (end - component);
+
+            char name[length + 1];
+            memcpy(name, component, length);
+            name[length] = '\0';
+
+            may_match = fnmatch(pattern->components[j], name, 0) == 0;
+            component += length + 1;
+        }
+
+        if (may_match)
+            return true;
+    }
+
+    return false;
+}
+
+void free_patterns(char** patterns) {
+    for (char** pattern = patterns; *pattern != NULL; pattern++) {
+        free(*pattern);
+    }
+    free(patterns);
+}
+
+/* Read patterns from a file, one per line, ignoring empty lines and comments starting with #
+ * Returns a NULL-terminated list, which must be freed with free_patterns */
+char** read_pattern_file(const char* const path) {
+    FILE* f = fopen(path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "Failed to open pattern file %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    size_t count = 0;
+    size_t capacity = 16;
+    char** patterns = malloc(capacity * sizeof(char*));
+
+    char* line = NULL;
+    size_t line_size = 0;
+    ssize_t length;
+    while (patterns != NULL && (length = getline(&line, &line_size, f)) != -1) {
+        while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+            line[--length] = '\0';
+
+        if (length == 0 || line[0] == '#')
+            continue;
+
+        // leave room for the terminating NULL
+        if (count + 1 == capacity) {
+            capacity *= 2;
+            char** resized = realloc(patterns, capacity * sizeof(char*));
+            if (resized == NULL) {
+                patterns[count] = NULL;
+                free_patterns(patterns);
+                patterns = NULL;
+                break;
+            }
+            patterns = resized;
+        }
+        patterns[count++] = strdup(line);
+    }
+
+    free(line);
+    fclose(f);
+
+    if (patterns == NULL) {
+        fprintf(stderr, "Failed allocating memory for patterns\n");
+        return NULL;
+    }
+
+    patterns[count] = NULL;
+    return patterns;
+}
+
+/* Statistics collected while extracting, see --appimage-extract-stats */
+#define EXTRACT_STATS_SLOWEST_FILES 10
+
+struct extract_file_time {
+    const char* path;
+    uint64_t ns;
+};
+
+struct extract_stats {
+    // bytes read from the image (data blocks as stored, i.e., usually compressed) and written to disk
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    // bytes taken from fragments, which are shared between files, and hence not included in bytes_in
+    uint64_t fragment_bytes;
+    size_t regular_files;
+    size_t hardlinks;
+    size_t directories;
+    size_t symlinks;
+    size_t skipped;
+    // time spent reading and decompressing data, writing it, and in all other syscalls (creating files, setting
+    // modes, ...), summed up over all workers
+    uint64_t read_ns;
+    uint64_t write_ns;
+    uint64_t metadata_ns;
+    uint64_t total_ns;
+    // counters of the fragment cache shared by all workers
+    size_t fragment_cache_hits;
+    size_t fragment_cache_misses;
+    size_t fragment_cache_evictions;
+    // sorted by time taken, slowest first; files written through io_uring are not timed individually
+    struct extract_file_time slowest[EXTRACT_STATS_SLOWEST_FILES];
+    size_t slowest_count;
+};
+
+void extract_stats_init(struct extract_stats* stats) {
+    memset(stats, 0, sizeof(*stats));
+}
+
+/* Add the time passed since *lap_start to *counter, and start the next lap */
+void extract_stats_lap(uint64_t* const counter, uint64_t* const lap_start) {
+    const uint64_t now = monotonic_time_ns();
+    *counter += now - *lap_start;
+    *lap_start = now;
+}
+
+void extract_stats_add_file_time(struct extract_stats* stats, const char* const path, const uint64_t ns) {
+    size_t i = stats->slowest_count;
+    if (i == EXTRACT_STATS_SLOWEST_FILES) {
+        if (ns <= stats->slowest[i - 1].ns)
+            return;
+        i--;
+    } else {
+        stats->slowest_count++;
+    }
+
+    for (; i > 0 && stats->slowest[i - 1].ns < ns; i--)
+        stats->slowest[i] = stats->slowest[i - 1];
+
+    stats->slowest[i].path = path;
+    stats->slowest[i].ns = ns;
+}
+
+void extract_stats_free(struct extract_stats* stats) {
+    for (size_t i = 0; i < stats->slowest_count; i++)
+        free((char*) stats->slowest[i].path);
+    stats->slowest_count = 0;
+}
+
+void extract_stats_merge(struct extract_stats* stats, const struct extract_stats* other) {
+    stats->bytes_in += other->bytes_in;
+    stats->bytes_out += other->bytes_out;
+    stats->fragment_bytes += other->fragment_bytes;
+    stats->regular_files += other->regular_files;
+    stats->hardlinks += other->hardlinks;
+    stats->directories += other->directories;
+    stats->symlinks += other->symlinks;
+    stats->skipped += other->skipped;
+    stats->read_ns += other->read_ns;
+    stats->write_ns += other->write_ns;
+    stats->metadata_ns += other->metadata_ns;
+    stats->fragment_cache_hits += other->fragment_cache_hits;
+    stats->fragment_cache_misses += other->fragment_cache_misses;
+    stats->fragment_cache_evictions += other->fragment_cache_evictions;
+
+    for (size_t i = 0; i < other->slowest_count; i++)
+        extract_stats_add_file_time(stats, other->slowest[i].path, other->slowest[i].ns);
+}
+
+/* A regular file found while traversing the image, to be written by one of the extraction workers
+ * Paths are relative to the extraction prefix */
+struct extract_job {
+    sqfs_inode_id inode_id;
+    const char* path;
+    // the file is created relative to its parent directory's fd, so that the workers don't resolve the whole path
+    // over and over again
+    int dir_fd;
+    const char* name;
+    // whether the file has holes, which must not be preallocated
+    bool sparse;
+    // where the file's data is stored, see extract_job_compare
+    uint32_t fragment;
+    uint64_t position;
+};
+
+/* Order in which files are extracted, which makes the reads from the image (almost) sequential
+ * Files with data blocks come first, in the order their blocks are stored in, followed by the files stored in a
+ * fragment only, grouped by their fragment, so that each fragment is decompressed only once. */
+int extract_job_compare(const void* a, const void* b) {
+    const struct extract_job* job_a = a;
+    const struct extract_job* job_b = b;
+
+    if (job_a->fragment != job_b->fragment) {
+        // SQUASHFS_INVALID_FRAG is used for files with data blocks
+        if (job_a->fragment == SQUASHFS_INVALID_FRAG)
+            return -1;
+        if (job_b->fragment == SQUASHFS_INVALID_FRAG)
+            return 1;
+        return job_a->fragment < job_b->fragment ? -1 : 1;
+    }
+
+    if (job_a->position != job_b->position)
+        return job_a->position < job_b->position ? -1 : 1;
+
+    return 0;
+}
+
+/* A hardlink to be created once the file it points to has been extracted */
+struct extract_link {
+    const char* target;
+    const char* path;
+};
+
+/* State shared by all extraction workers */
+struct extract_queue {
+    const char* appimage_path;
+    // used for messages only, all files are created relative to root_fd
+    const char* prefix;
+    int root_fd;
+    struct extract_job* jobs;
+    size_t jobs_count;
+    size_t next_job;
+    bool overwrite;
+    // the process's umask, which can't be queried without changing it, and hence not from the workers
+    mode_t umask;
+    bool failed;
+    // the workers' statistics are added to these once they're done
+    struct extract_stats* stats;
+    // points to block_cache, unless the cache is disabled
+    struct block_cache* fragment_cache;
+    struct block_cache block_cache;
+    // the directories the jobs' dir_fd refer to, closed once all files have been extracted
+    int* dir_fds;
+    size_t dir_fds_count;
+    size_t dir_fds_capacity;
+    size_t dir_fds_limit;
+#ifdef ENABLE_IO_URING
+    // number of files each worker batches, all of which are open at the same time
+    size_t uring_batch_files;
+#endif
+    pthread_mutex_t mutex;
+};
+
+/* write(2) until all data has been written */
+bool write_all(const int fd, const void* data, size_t size) {
+    const char* p = data;
+
+    while (size > 0) {
+        ssize_t written = write(fd, p, size);
+        if (written == -1) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        p += written;
+        size -= written;
+    }
+
+    return true;
+}
+
+/* Write size zero bytes to fd */
+bool write_zeroes(const int fd, size_t size) {
+    static const char zeroes[4096];
+
+    while (size > 0) {
+        size_t chunk = size < sizeof(zeroes) ? size : sizeof(zeroes);
+        if (!write_all(fd, zeroes, chunk))
+            return false;
+        size -= chunk;
+    }
+
+    return true;
+}
+
+/* Copy size bytes at offset in image_fd to the current position of fd
+ * copy_file_range lets the kernel copy the data without passing it through userspace, or even share it on file systems
+ * supporting reflinks. It is called through syscall, as older C libraries lack a wrapper. If fd is a pipe, splice does
+ * the same. If neither works, the data is copied by hand instead. Neither of them supports files opened with O_APPEND
+ * (e.g., --appimage-cat redirected with >>), which are always written to by hand. */
+bool copy_image_range(const int image_fd, off_t offset, const int fd, size_t size) {
+    // the image and the destination are the same for all files extracted, so there's no need to try again
+    static bool copy_file_range_unsupported = false;
+    static bool splice_unsupported = false;
+
+    const int flags = fcntl(fd, F_GETFL);
+    const bool append = flags == -1 || (flags & O_APPEND) != 0;
+
+#ifdef __NR_copy_file_range
+    while (size > 0 && !append && !__atomic_load_n(&copy_file_range_unsupported, __ATOMIC_RELAXED)) {
+        ssize_t copied = syscall(__NR_copy_file_range, image_fd, &offset, fd, NULL, size, 0);
+
+        if (copied == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno != ENOSYS && errno != EXDEV && errno != EOPNOTSUPP && errno != EINVAL)
+                return false;
+            __atomic_store_n(&copy_file_range_unsupported, true, __ATOMIC_RELAXED);
+        } else if (copied == 0) {
+            errno = EIO;
+            return false;
+        } else {
+            size -= copied;
+        }
+    }
+#else
+    (void) copy_file_range_unsupported;
+#endif
+
+    while (size > 0 && !append && !__atomic_load_n(&splice_unsupported, __ATOMIC_RELAXED)) {
+        ssize_t copied = splice(image_fd, &offset, fd, NULL, size, 0);
+
+        if (copied == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno != ENOSYS && errno != EINVAL)
+                return false;
+            __atomic_store_n(&splice_unsupported, true, __ATOMIC_RELAXED);
+        } else if (copied == 0) {
+            errno = EIO;
+            return false;
+        } else {
+            size -= copied;
+        }
+    }
+
+    if (size == 0)
+        return true;
+
+    char* buffer = malloc(size);
+    if (buffer == NULL)
+        return false;
+
+    bool rv;
+    ssize_t read_size = pread(image_fd, buffer, size, offset);
+    if (read_size != (ssize_t) size) {
+        // a short read means the image is truncated
+        if (read_size >= 0)
+            errno = EIO;
+        rv = false;
+    } else {
+        rv = write_all(fd, buffer, size);
+    }
+
+    free(buffer);
+    return rv;
+}
+
+/* Write the contents of a regular file inode to name, relative to the directory dir_fd
+ * path is the file's path relative to prefix, used in messages */
+bool extract_regular_file(sqfs* fs, sqfs_inode* inode, const int dir_fd, const char* const name, const char* const prefix, const char* const path, const bool overwrite, const bool sparse, struct block_cache* fragment_cache, struct extract_stats* stats) {
+    const uint64_t file_start = monotonic_time_ns();
+    uint64_t lap_start = file_start;
+
+    struct stat st;
+    if (!overwrite && fstatat(dir_fd, name, &st, 0) == 0 && st.st_size == inode->xtra.reg.file_size) {
+        fprintf(stderr, "File exists and file size matches, skipping\n");
+        stats->skipped++;
+        extract_stats_lap(&stats->metadata_ns, &lap_start);
+        return true;
+    }
+
+    if (private_sqfs_stat(fs, inode, &st) != 0)
+        die("private_sqfs_stat error");
+
+    int fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        fprintf(stderr, "Failed to open %s%s for writing: %s\n", prefix, path, strerror(errno));
+        return false;
+    }
+
+    bool rv = true;
+
+    const off_t file_size = (off_t) inode->xtra.reg.file_size;
+    if (sparse) {
+        // holes are skipped while writing, hence the file must be extended to its final size explicitly
+        if (ftruncate(fd, file_size) != 0) {
+            fprintf(stderr, "Failed to resize %s%s: %s\n", prefix, path, strerror(errno));
+            rv = false;
+        }
+    } else if (file_size > 0 && fallocate(fd, 0, 0, file_size) != 0) {
+        // allocating all space up front avoids fragmentation; not all file systems support it, though
+        if (errno == ENOSPC || errno == EDQUOT) {
+            fprintf(stderr, "Failed to allocate space for %s%s: %s\n", prefix, path, strerror(errno));
+            rv = false;
+        }
+    }
+
+    extract_stats_lap(&stats->metadata_ns, &lap_start);
+
+    if (inode->xtra.reg.frag_idx != SQUASHFS_INVALID_FRAG) {
+        stats->fragment_bytes += inode->xtra.reg.file_size % fs->sb.block_size;
+    }
+
+    // write the file one whole block at a time
+    struct file_block_stream stream;
+    file_block_stream_init(&stream, fs, inode);
+    stream.passthrough = true;
+    stream.fragment_cache = fragment_cache;
+
+    const void* data;
+    size_t size;
+    sqfs_err err = SQFS_OK;
+    while (rv && file_block_stream_next(&stream, &data, &size, &err)) {
+        extract_stats_lap(&stats->read_ns, &lap_start);
+        stats->bytes_in += stream.stored_size;
+
+        if (stream.passthrough_offset != -1) {
+            if (!copy_image_range(fs->fd, stream.passthrough_offset, fd, size)) {
+                fprintf(stderr, "Failed to copy data to %s%s: %s\n", prefix, path, strerror(errno));
+                rv = false;
+            }
+            stats->bytes_out += size;
+        } else if (data == NULL) {
+            // leave a hole in the file
+            if (lseek(fd, (off_t) size, SEEK_CUR) == -1) {
+                fprintf(stderr, "Failed to seek in %s%s: %s\n", prefix, path, strerror(errno));
+                rv = false;
+            }
+        } else {
+            if (!write_all(fd, data, size)) {
+                fprintf(stderr, "Failed to write %s%s: %s\n", prefix, path, strerror(errno));
+                rv = false;
+            }
+            stats->bytes_out += size;
+        }
+
+        extract_stats_lap(&stats->write_ns, &lap_start);
+    }
+    if (err != SQFS_OK) {
+        fprintf(stderr, "Failed to read data of %s from squashfs image\n", path);
+        rv = false;
+    }
+    file_block_stream_close(&stream);
+
+    // the mode passed to openat is subject to the umask, and does not apply to existing files
+    fchmod(fd, st.st_mode);
+
+    if (close(fd) != 0) {
+        fprintf(stderr, "Failed to close %s%s: %s\n", prefix, path, strerror(errno));
+        rv = false;
+    }
+
+    extract_stats_lap(&stats->metadata_ns, &lap_start);
+    stats->regular_files++;
+    extract_stats_add_file_time(stats, path, lap_start - file_start);
+
+    return rv;
+}
+
+#ifdef ENABLE_IO_URING
+/* io_uring backend for extracting many small files
+ * Writing a small file synchronously costs an openat, a write, an fchmod and a close syscall. Instead, the data of up
+ * to URING_BATCH_FILES small files is decompressed into memory first, then all of them are opened with a single
+ * io_uring_enter, and written and closed with a second one. The mode is passed to openat right away, an fchmod is
+ * only needed if the umask would strip bits from it.
+ * liburing is not used to keep the runtime's dependencies minimal; the few bits needed are implemented below.
+ * Whenever something unusual happens (e.g., the file exists already, or a write is short), the file is extracted
+ * using the synchronous path instead, which takes care of reporting errors.
+ * It has not been benchmarked against the synchronous path, which is why it is disabled by default. */
+#define URING_BATCH_FILES 128
+#define URING_SMALL_FILE_SIZE (32 * 1024)
+
+struct uring {
+    int fd;
+    unsigned entries;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+bool uring_init(struct uring* ring, const unsigned entries) {
+    memset(ring, 0, sizeof(*ring));
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    ring->fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+        return false;
+
+    ring->entries = params.sq_entries;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    const bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap) {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        close(ring->fd);
+        return false;
+    }
+
+    if (single_mmap) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            munmap(ring->sq_ring, ring->sq_ring_size);
+            close(ring->fd);
+            return false;
+        }
+    }
+
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (!single_mmap)
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->fd);
+        return false;
+    }
+
+    char* sq = ring->sq_ring;
+    ring->sq_head = (unsigned*) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*) (sq + params.sq_off.array);
+
+    char* cq = ring->cq_ring;
+    ring->cq_head = (unsigned*) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+
+    return true;
+}
+
+void uring_free(struct uring* ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+/* Queue a submission, the ring must have room for it (i.e., callers never queue more than ring->entries at once) */
+struct io_uring_sqe* uring_get_sqe(struct uring* ring) {
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+/* Pass all completions posted so far to callback, returns their number */
+unsigned uring_reap(struct uring* ring, void (*callback)(void*, __u64, __s32), void* data) {
+    unsigned completed = 0;
+
+    unsigned head = *ring->cq_head;
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+        callback(data, cqe->user_data, cqe->res);
+        head++;
+        completed++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+    return completed;
+}
+
+/* Drop the submissions the kernel hasn't picked up yet, and wait until the in_flight ones it has are completed
+ * Tearing down a ring does not wait for requests in flight, which might still read from buffers or return fds
+ * afterwards, therefore this must be done before a ring is given up on. */
+void uring_drain(struct uring* ring, unsigned in_flight, void (*callback)(void*, __u64, __s32), void* data) {
+    __atomic_store_n(ring->sq_tail, __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+
+    while (in_flight > 0) {
+        if (syscall(__NR_io_uring_enter, ring->fd, 0, in_flight, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+            // completions are posted without waiting for them as well, it just takes a little longer to notice
+            const struct timespec delay = {0, 1000 * 1000};
+            nanosleep(&delay, NULL);
+        }
+
+        unsigned completed = uring_reap(ring, callback, data);
+        in_flight -= completed < in_flight ? completed : in_flight;
+    }
+}
+
+/* Submit all queued submissions, and wait for count completions, which are passed to callback
+ * Returns false if io_uring_enter fails, in which case the ring has been drained (see uring_drain) */
+bool uring_submit_and_wait(struct uring* ring, const unsigned count, void (*callback)(void*, __u64, __s32), void* data) {
+    // all earlier submissions have been picked up by the kernel, so this is where the ones for this call start
+    const unsigned sq_start = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned submitted = 0;
+    unsigned completed = 0;
+
+    while (completed < count) {
+        int rv = (int) syscall(__NR_io_uring_enter, ring->fd, count - submitted, count - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (rv < 0) {
+            if (errno == EINTR)
+                continue;
+
+            const unsigned consumed = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) - sq_start;
+            uring_drain(ring, consumed - completed, callback, data);
+            return false;
+        }
+        submitted += rv;
+
+        completed += uring_reap(ring, callback, data);
+    }
+
+    return true;
+}
+
+struct uring_batch_file {
+    const struct extract_job* job;
+    sqfs_inode inode;
+    size_t data_offset;
+    int fd;
+    // set if the file has to be extracted using the synchronous path
+    bool fallback;
+};
+
+struct uring_batch {
+    struct uring ring;
+    bool available;
+    struct uring_batch_file files[URING_BATCH_FILES];
+    size_t count;
+    char* data;
+    size_t data_size;
+};
+
+void uring_batch_init(struct uring_batch* batch) {
+    memset(batch, 0, sizeof(*batch));
+
+    // every file needs up to two submissions at once (write and close)
+    batch->available = uring_init(&batch->ring, 2 * URING_BATCH_FILES);
+    if (!batch->available)
+        return;
+
+    batch->data = malloc(URING_BATCH_FILES * URING_SMALL_FILE_SIZE);
+    if (batch->data == NULL) {
+        uring_free(&batch->ring);
+        batch->available = false;
+    }
+}
+
+void uring_batch_free(struct uring_batch* batch) {
+    // batching might have been disabled along the way, the ring is set up as long as there is a buffer
+    if (batch->data != NULL) {
+        uring_free(&batch->ring);
+        free(batch->data);
+        batch->data = NULL;
+    }
+    batch->available = false;
+}
+
+/* Give up on io_uring after io_uring_enter failed
+ * uring_submit_and_wait has waited for everything in flight by now, hence nothing refers to the buffer or the files
+ * anymore, and the fds the completions returned are known. It's still not obvious which files are complete, so all
+ * files of the batch are extracted using the synchronous path instead. */
+void uring_batch_abandon(struct uring_batch* batch) {
+    for (size_t i = 0; i < batch->count; i++) {
+        if (batch->files[i].fd != -1)
+            close(batch->files[i].fd);
+        batch->files[i].fd = -1;
+        batch->files[i].fallback = true;
+    }
+
+    uring_batch_free(batch);
+}
+
+/* Decompress a small file into the batch, returns false on errors */
+bool uring_batch_add(struct uring_batch* batch, sqfs* fs, sqfs_inode* inode, const struct extract_job* job, struct block_cache* fragment_cache, struct extract_stats* stats) {
+    uint64_t lap_start = monotonic_time_ns();
+
+    struct uring_batch_file* file = &batch->files[batch->count];
+    file->job = job;
+    file->inode = *inode;
+    file->data_offset = batch->data_size;
+    file->fd = -1;
+    file->fallback = false;
+
+    struct file_block_stream stream;
+    file_block_stream_init(&stream, fs, &file->inode);
+    stream.fragment_cache = fragment_cache;
+
+    const void* data;
+    size_t size;
+    sqfs_err err;
+    while (file_block_stream_next(&stream, &data, &size, &err)) {
+        stats->bytes_in += stream.stored_size;
+        if (batch->data_size + size > file->data_offset + URING_SMALL_FILE_SIZE) {
+            err = SQFS_ERR;
+            break;
+        }
+        if (data == NULL)
+            memset(batch->data + batch->data_size, 0, size);
+        else
+            memcpy(batch->data + batch->data_size, data, size);
+        batch->data_size += size;
+    }
+    file_block_stream_close(&stream);
+
+    extract_stats_lap(&stats->read_ns, &lap_start);
+
+    if (err != SQFS_OK) {
+        fprintf(stderr, "Failed to read data of %s from squashfs image\n", job->path);
+        return false;
+    }
+
+    if (inode->xtra.reg.frag_idx != SQUASHFS_INVALID_FRAG) {
+        stats->fragment_bytes += inode->xtra.reg.file_size % fs->sb.block_size;
+    }
+
+    batch->count++;
+    return true;
+}
+
+void uring_batch_open_completed(void* data, __u64 user_data, __s32 res) {
+    struct uring_batch* batch = data;
+    struct uring_batch_file* file = &batch->files[user_data];
+
+    if (res >= 0) {
+        file->fd = res;
+    } else {
+        // io_uring reports unsupported operations as EINVAL, no need to try again in that case
+        if (res == -EINVAL)
+            batch->available = false;
+        file->fallback = true;
+    }
+}
+
+void uring_batch_write_completed(void* data, __u64 user_data, __s32 res) {
+    struct uring_batch* batch = data;
+    // the lowest bit tells writes and closes apart
+    struct uring_batch_file* file = &batch->files[user_data >> 1];
+
+    if ((user_data & 1) == 0) {
+        if (res < 0 || (__u64) res != file->inode.xtra.reg.file_size)
+            file->fallback = true;
+    } else {
+        // if the write failed or was short, the linked close is canceled
+        if (res == -ECANCELED)
+            close(file->fd);
+        else if (res < 0)
+            file->fallback = true;
+        file->fd = -1;
+    }
+}
+
+/* Write all files in the batch, then empty it */
+bool uring_batch_flush(struct uring_batch* batch, sqfs* fs, struct extract_queue* queue, struct extract_stats* stats) {
+    const mode_t mode_mask = 07777;
+
+    if (batch->count == 0)
+        return true;
+
+    // the syscalls for all files are submitted at once, hence the time can't be attributed to individual files
+    uint64_t lap_start = monotonic_time_ns();
+
+    bool rv = true;
+
+    // 1. create all files, existing ones are handled by the synchronous path, which knows how to deal with them
+    for (size_t i = 0; i < batch->count; i++) {
+        struct io_uring_sqe* sqe = uring_get_sqe(&batch->ring);
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = batch->files[i].job->dir_fd;
+        sqe->addr = (__u64) (uintptr_t) batch->files[i].job->name;
+        sqe->len = batch->files[i].inode.base.mode & mode_mask;
+        sqe->open_flags = O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC;
+        sqe->user_data = i;
+    }
+
+    if (!uring_submit_and_wait(&batch->ring, (unsigned) batch->count, uring_batch_open_completed, batch))
+        uring_batch_abandon(batch);
+
+    // 2. write and close them
+    unsigned submissions = 0;
+    for (size_t i = 0; batch->data != NULL && i < batch->count; i++) {
+        struct uring_batch_file* file = &batch->files[i];
+        if (file->fd == -1)
+            continue;
+
+        if (file->inode.xtra.reg.file_size > 0) {
+            struct io_uring_sqe* sqe = uring_get_sqe(&batch->ring);
+            sqe->opcode = IORING_OP_WRITE;
+            sqe->flags = IOSQE_IO_LINK;
+            sqe->fd = file->fd;
+            sqe->addr = (__u64) (uintptr_t) (batch->data + file->data_offset);
+            sqe->len = (__u32) file->inode.xtra.reg.file_size;
+            sqe->off = 0;
+            sqe->user_data = i << 1;
+            submissions++;
+        }
+
+        struct io_uring_sqe* sqe = uring_get_sqe(&batch->ring);
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = file->fd;
+        sqe->user_data = (i << 1) | 1;
+        submissions++;
+    }
+
+    if (submissions > 0 && !uring_submit_and_wait(&batch->ring, submissions, uring_batch_write_completed, batch)) {
+        // we can't tell which files have been written, hence write all of them again
+        uring_batch_abandon(batch);
+    }
+
+    // 3. fix up modes the umask stripped bits from, and extract everything which didn't work out synchronously
+    for (size_t i = 0; rv && i < batch->count; i++) {
+        struct uring_batch_file* file = &batch->files[i];
+
+        if (file->fallback) {
+            rv = extract_regular_file(fs, &file->inode, file->job->dir_fd, file->job->name, queue->prefix, file->job->path, queue->overwrite, file->job->sparse, queue->fragment_cache, stats);
+            lap_start = monotonic_time_ns();
+            continue;
+        }
+
+        if ((file->inode.base.mode & mode_mask & ~queue->umask) != (file->inode.base.mode & mode_mask))
+            fchmodat(file->job->dir_fd, file->job->name, file->inode.base.mode & mode_mask, 0);
+
+        stats->regular_files++;
+        stats->bytes_out += file->inode.xtra.reg.file_size;
+    }
+
+    extract_stats_lap(&stats->write_ns, &lap_start);
+
+    batch->count = 0;
+    batch->data_size = 0;
+    return rv;
+}
+#endif
+
+/* Extraction worker: picks jobs off the shared queue until it is drained or another worker failed
+ * sqfs is not thread-safe (the caches in particular), therefore every worker opens the image on its own */
+void* extract_worker(void* arg) {
+    struct extract_queue* queue = arg;
+
+    sqfs fs;
+    if (sqfs_open_image(&fs, queue->appimage_path, (size_t) fs_offset)) {
+        fprintf(stderr, "Failed to open squashfs image\n");
+        pthread_mutex_lock(&queue->mutex);
+        queue->failed = true;
+        pthread_mutex_unlock(&queue->mutex);
+        return NULL;
+    }
+
+    struct extract_stats stats;
+    extract_stats_init(&stats);
+
+#ifdef ENABLE_IO_URING
+    struct uring_batch batch;
+    uring_batch_init(&batch);
+#endif
+
+    for (;;) {
+        // take more than one job at once when batching small files
+        size_t jobs_at_a_time = 1;
+        size_t max_jobs_at_a_time = SIZE_MAX;
+#ifdef ENABLE_IO_URING
+        if (batch.available) {
+            jobs_at_a_time = queue->uring_batch_files;
+            max_jobs_at_a_time = queue->uring_batch_files;
+        }
+#endif
+
+        size_t first_job = 0;
+        size_t jobs_count = 0;
+
+        pthread_mutex_lock(&queue->mutex);
+        if (!queue->failed && queue->next_job < queue->jobs_count) {
+            first_job = queue->next_job;
+            jobs_count = queue->jobs_count - queue->next_job;
+            if (jobs_count > jobs_at_a_time)
+                jobs_count = jobs_at_a_time;
+
+            // take all the files stored in the same fragment, which is then decompressed by this worker only
+            const uint32_t fragment = queue->jobs[first_job + jobs_count - 1].fragment;
+            while (fragment != SQUASHFS_INVALID_FRAG && jobs_count < max_jobs_at_a_time &&
+                   first_job + jobs_count < queue->jobs_count && queue->jobs[first_job + jobs_count].fragment == fragment)
+                jobs_count++;
+
+            queue->next_job += jobs_count;
+        }
+        pthread_mutex_unlock(&queue->mutex);
+
+        if (jobs_count == 0)
+            break;
+
+        bool success = true;
+
+        for (size_t i = first_job; success && i < first_job + jobs_count; i++) {
+            struct extract_job* job = &queue->jobs[i];
+
+            sqfs_inode inode;
+            if (sqfs_inode_get(&fs, &inode, job->inode_id)) {
+                fprintf(stderr, "sqfs_inode_get error\n");
+                success = false;
+                break;
+            }
+
+#ifdef ENABLE_IO_URING
+            if (batch.available && inode.xtra.reg.file_size <= URING_SMALL_FILE_SIZE) {
+                success = uring_batch_add(&batch, &fs, &inode, job, queue->fragment_cache, &stats);
+                continue;
+            }
+#endif
+
+            success = extract_regular_file(&fs, &inode, job->dir_fd, job->name, queue->prefix, job->path, queue->overwrite, job->sparse, queue->fragment_cache, &stats);
+        }
+
+#ifdef ENABLE_IO_URING
+        if (success) {
+            success = uring_batch_flush(&batch, &fs, queue, &stats);
+        } else {
+            batch.count = 0;
+            batch.data_size = 0;
+        }
+#endif
+
+        if (!success) {
+            pthread_mutex_lock(&queue->mutex);
+            queue->failed = true;
+            pthread_mutex_unlock(&queue->mutex);
+            break;
+        }
+    }
+
+#ifdef ENABLE_IO_URING
+    uring_batch_free(&batch);
+#endif
+
+    if (queue->stats != NULL) {
+        pthread_mutex_lock(&queue->mutex);
+        extract_stats_merge(queue->stats, &stats);
+        pthread_mutex_unlock(&queue->mutex);
+    }
+
+    sqfs_destroy(&fs);
+    sqfs_fd_close(fs.fd);
+
+    return NULL;
+}
+
+/* Extract all queued regular files, using up to threads workers (the calling thread being one of them) */
+bool run_extract_workers(struct extract_queue* queue, int threads) {
+    queue->umask = umask(0);
+    umask(queue->umask);
+
+    if ((size_t) threads > queue->jobs_count)
+        threads = queue->jobs_count > 0 ? (int) queue->jobs_count : 1;
+
+#ifdef ENABLE_IO_URING
+    // the files of all workers' batches are open at the same time, leave half of the fd limit for everything else
+    queue->uring_batch_files = URING_BATCH_FILES;
+
+    struct rlimit fd_limit;
+    if (getrlimit(RLIMIT_NOFILE, &fd_limit) == 0 && fd_limit.rlim_cur != RLIM_INFINITY) {
+        rlim_t per_worker = fd_limit.rlim_cur / (2 * (rlim_t) threads);
+        if (per_worker < URING_BATCH_FILES)
+            queue->uring_batch_files = per_worker > 0 ? (size_t) per_worker : 1;
+    }
+#endif
+
+    pthread_t workers[threads];
+    int started = 0;
+
+    for (int i = 1; i < threads; i++) {
+        int error = pthread_create(&workers[started], NULL, extract_worker, queue);
+        if (error != 0) {
+            // not fatal, the remaining workers will pick up the jobs
+            fprintf(stderr, "Failed to start extraction thread: %s\n", strerror(error));
+            break;
+        }
+        started++;
+    }
+
+    extract_worker(queue);
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    return !queue->failed;
+}
+
+/* The directories on the path from the extraction prefix to the entry currently being traversed
+ * Directories are created when they match the pattern themselves, or once something inside them is extracted. They
+ * are opened on demand, so that entries can be created relative to their parent directory's fd rather than by path. */
+struct extract_dir {
+    char* name;
+    int fd;
+    bool created;
+    // the fd has been handed over to the extraction queue, which closes it
+    bool queued;
+};
+
+struct extract_dir_stack {
+    int root_fd;
+    struct extract_dir* dirs;
+    size_t depth;
+    size_t capacity;
+};
+
+bool extract_dir_stack_push(struct extract_dir_stack* stack, const char* const name, const bool created) {
+    if (stack->depth == stack->capacity) {
+        size_t capacity = stack->capacity == 0 ? 16 : stack->capacity * 2;
+        struct extract_dir* dirs = realloc(stack->dirs, capacity * sizeof(struct extract_dir));
+        if (dirs == NULL)
+            return false;
+        stack->dirs = dirs;
+        stack->capacity = capacity;
+    }
+
+    struct extract_dir* dir = &stack->dirs[stack->depth];
+    dir->name = strdup(name);
+    if (dir->name == NULL)
+        return false;
+    dir->fd = -1;
+    dir->created = created;
+    dir->queued = false;
+    stack->depth++;
+
+    return true;
+}
+
+/* Leave all directories below the given depth */
+void extract_dir_stack_truncate(struct extract_dir_stack* stack, const size_t depth) {
+    while (stack->depth > depth) {
+        struct extract_dir* dir = &stack->dirs[--stack->depth];
+        if (dir->fd != -1 && !dir->queued)
+            close(dir->fd);
+        free(dir->name);
+    }
+}
+
+/* Get an fd for the directory at the given depth (0 being the prefix), creating it and its parents if necessary
+ * Returns -1 on errors */
+int extract_dir_stack_fd(struct extract_dir_stack* stack, const size_t depth) {
+    for (size_t i = 0; i < depth; i++) {
+        struct extract_dir* dir = &stack->dirs[i];
+        if (dir->fd != -1)
+            continue;
+
+        const int parent_fd = i == 0 ? stack->root_fd : stack->dirs[i - 1].fd;
+
+        if (!dir->created) {
+            if (mkdirat(parent_fd, dir->name, 0755) == -1 && errno != EEXIST)
+                return -1;
+            dir->created = true;
+        }
+
+        dir->fd = openat(parent_fd, dir->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir->fd == -1)
+            return -1;
+    }
+
+    return depth == 0 ? stack->root_fd : stack->dirs[depth - 1].fd;
+}
+
+/* Keep the (open) directory at the given depth open until the queued files have been extracted
+ * Returns false if no more directories can be kept open, in which case files have to be created relative to the
+ * prefix instead */
+bool extract_dir_stack_keep_fd(struct extract_dir_stack* stack, struct extract_queue* queue, const size_t depth) {
+    if (depth == 0)
+        return true;
+
+    struct extract_dir* dir = &stack->dirs[depth - 1];
+    if (dir->queued)
+        return true;
+
+    if (queue->dir_fds_count == queue->dir_fds_limit)
+        return false;
+
+    if (queue->dir_fds_count == queue->dir_fds_capacity) {
+        size_t capacity = queue->dir_fds_capacity == 0 ? 64 : queue->dir_fds_capacity * 2;
+        int* dir_fds = realloc(queue->dir_fds, capacity * sizeof(int));
+        if (dir_fds == NULL)
+            return false;
+        queue->dir_fds = dir_fds;
+        queue->dir_fds_capacity = capacity;
+    }
+
+    queue->dir_fds[queue->dir_fds_count++] = dir->fd;
+    dir->queued = true;
+
+    return true;
+}
+
+/* Number of directory fds the extraction queue may keep open
+ * A quarter of the fd limit, as the io_uring batches take up to half of it */
+size_t extract_dir_fds_limit(void) {
+    struct rlimit fd_limit;
+    if (getrlimit(RLIMIT_NOFILE, &fd_limit) != 0 || fd_limit.rlim_cur == RLIM_INFINITY)
+        return SIZE_MAX;
+
+    return (size_t) (fd_limit.rlim_cur / 4);
+}
+
+/* State of an extraction while traversing (or looking up entries in) the image */
+struct extract_context {
+    sqfs* fs;
+    const char* prefix;
+    bool verbose;
+    struct extract_dir_stack dirs;
+    // directories and symlinks are created right away
+    // regular files are collected and extracted afterwards, possibly in parallel
+    struct extract_queue queue;
+    size_t jobs_capacity;
+    // hardlinks are created once all regular files have been extracted
+    struct extract_link* links;
+    size_t links_count;
+    size_t links_capacity;
+    // track duplicate inodes for hardlinks
+    struct hardlink_map created_inodes;
+    // the paths of all files and hardlinks
+    struct string_arena paths;
+    // number of bytes the queued files will occupy, excluding holes
+    uint64_t required_size;
+    // the workers add their statistics to these as well
+    struct extract_stats stats;
+};
+
+/* Extract a single entry, found at path (relative to the root of the image)
+ * depth is the number of slashes in path, name its last component. The directory stack must contain exactly the
+ * entry's parent directories. */
+bool extract_entry(struct extract_context* ctx, const char* const path, const size_t depth, const char* const name, const sqfs_inode_id inode_id) {
+    // fprintf(stderr, "path: %s\n", path);
+    // fprintf(stderr, "sqfs_inode_id: %lu\n", inode_id);
+    sqfs_inode inode;
+    if (sqfs_inode_get(ctx->fs, &inode, inode_id)) {
+        fprintf(stderr, "sqfs_inode_get error\n");
+        return false;
+    }
+    // fprintf(stderr, "inode.base.inode_type: %i\n", inode.base.inode_type);
+    // fprintf(stderr, "inode.xtra.reg.file_size: %lu\n", inode.xtra.reg.file_size);
+
+    if (ctx->verbose)
+        fprintf(stdout, "%s%s\n", ctx->prefix, path);
+
+    // the parent directory might not have matched the pattern, and therefore not exist yet
+    const int parent_fd = extract_dir_stack_fd(&ctx->dirs, depth);
+    if (parent_fd == -1) {
+        fprintf(stderr, "Failed to create parent directory of %s%s: %s\n", ctx->prefix, path, strerror(errno));
+        return false;
+    }
+
+    if (inode.base.inode_type == SQUASHFS_DIR_TYPE || inode.base.inode_type == SQUASHFS_LDIR_TYPE) {
+        if (mkdirat(parent_fd, name, 0755) == -1 && errno != EEXIST) {
+            fprintf(stderr, "Failed to create directory %s%s: %s\n", ctx->prefix, path, strerror(errno));
+            return false;
+        }
+        if (!extract_dir_stack_push(&ctx->dirs, name, true)) {
+            fprintf(stderr, "Failed allocating memory for directory stack\n");
+            return false;
+        }
+        ctx->stats.directories++;
+    } else if (inode.base.inode_type == SQUASHFS_REG_TYPE || inode.base.inode_type == SQUASHFS_LREG_TYPE) {
+        // if we've already seen this inode, then this is a hardlink
+        const char* existing_path_for_inode = NULL;
+        if (inode.nlink > 1)
+            existing_path_for_inode = hardlink_map_get(&ctx->created_inodes, inode.base.inode_number);
+
+        if (existing_path_for_inode != NULL) {
+            if (ctx->links_count == ctx->links_capacity) {
+                size_t capacity = ctx->links_capacity == 0 ? 64 : ctx->links_capacity * 2;
+                struct extract_link* links = realloc(ctx->links, capacity * sizeof(struct extract_link));
+                if (links == NULL) {
+                    fprintf(stderr, "Failed allocating memory to track hardlinks\n");
+                    return false;
+                }
+                ctx->links = links;
+                ctx->links_capacity = capacity;
+            }
+            struct extract_link* link = &ctx->links[ctx->links_count];
+            link->target = existing_path_for_inode;
+            link->path = string_arena_strdup(&ctx->paths, path);
+            if (link->path == NULL) {
+                fprintf(stderr, "Failed allocating memory to track hardlinks\n");
+                return false;
+            }
+            ctx->links_count++;
+            ctx->stats.hardlinks++;
+            return true;
+        }
+
+        struct extract_queue* queue = &ctx->queue;
+        if (queue->jobs_count == ctx->jobs_capacity) {
+            size_t capacity = ctx->jobs_capacity == 0 ? 1024 : ctx->jobs_capacity * 2;
+            struct extract_job* jobs = realloc(queue->jobs, capacity * sizeof(struct extract_job));
+            if (jobs == NULL) {
+                fprintf(stderr, "Failed allocating memory for extraction jobs\n");
+                return false;
+            }
+            queue->jobs = jobs;
+            ctx->jobs_capacity = capacity;
+        }
+        const char* job_path = string_arena_strdup(&ctx->paths, path);
+        if (job_path == NULL) {
+            fprintf(stderr, "Failed allocating memory for extraction jobs\n");
+            return false;
+        }
+        uint64_t sparse_bytes;
+        if (!file_sparse_bytes(ctx->fs, &inode, &sparse_bytes)) {
+            fprintf(stderr, "sqfs_blocklist_next error\n");
+            return false;
+        }
+        ctx->required_size += inode.xtra.reg.file_size - sparse_bytes;
+
+        queue->jobs[queue->jobs_count].inode_id = inode_id;
+        queue->jobs[queue->jobs_count].path = job_path;
+        if (extract_dir_stack_keep_fd(&ctx->dirs, queue, depth)) {
+            const char* last_slash = strrchr(job_path, '/');
+            queue->jobs[queue->jobs_count].dir_fd = parent_fd;
+            queue->jobs[queue->jobs_count].name = last_slash == NULL ? job_path : last_slash + 1;
+        } else {
+            queue->jobs[queue->jobs_count].dir_fd = queue->root_fd;
+            queue->jobs[queue->jobs_count].name = job_path;
+        }
+        queue->jobs[queue->jobs_count].sparse = sparse_bytes > 0;
+        if (inode.xtra.reg.frag_idx != SQUASHFS_INVALID_FRAG && inode.xtra.reg.file_size < ctx->fs->sb.block_size) {
+            queue->jobs[queue->jobs_count].fragment = inode.xtra.reg.frag_idx;
+            queue->jobs[queue->jobs_count].position = inode.xtra.reg.frag_off;
+        } else {
+            queue->jobs[queue->jobs_count].fragment = SQUASHFS_INVALID_FRAG;
+            queue->jobs[queue->jobs_count].position = inode.xtra.reg.start_block;
+        }
+        queue->jobs_count++;
+
+        // track the path we extract to for this inode, so that we can `link` if this inode is found again
+        if (inode.nlink > 1 && !hardlink_map_put(&ctx->created_inodes, inode.base.inode_number, job_path)) {
+            fprintf(stderr, "Failed allocating memory to track hardlinks\n");
+            return false;
+        }
+    } else if (inode.base.inode_type == SQUASHFS_SYMLINK_TYPE || inode.base.inode_type == SQUASHFS_LSYMLINK_TYPE) {
+        size_t size;
+        sqfs_readlink(ctx->fs, &inode, NULL, &size);
+        char buf[size];
+        int ret = sqfs_readlink(ctx->fs, &inode, buf, &size);
+        if (ret != 0) {
+            perror("symlink error");
+            return false;
+        }
+        // fprintf(stderr, "Symlink: %s to %s \n", path, buf);
+        unlinkat(parent_fd, name, 0);
+        ret = symlinkat(buf, parent_fd, name);
+        if (ret != 0)
+            fprintf(stderr, "WARNING: could not create symlink\n");
+        ctx->stats.symlinks++;
+    } else {
+        fprintf(stderr, "TODO: Implement inode.base.inode_type %i\n", inode.base.inode_type);
+        ctx->stats.skipped++;
+    }
+
+    return true;
+}
+
+/* Walk the image, calling callback for every entry matching the patterns (or all entries, if pattern_set is NULL)
+ * Directories which don't match but might contain matching entries are passed to callback too, with matches set to
+ * false, all other subtrees which can't contain matching entries are skipped. depth is the number of slashes in path,
+ * name its last component. Parents are always passed before their children. */
+bool traverse_image(sqfs* fs, const struct extract_pattern_set* pattern_set,
+                    bool (*callback)(void* data, const char* path, size_t depth, const char* name, sqfs_inode_id inode_id, bool matches),
+                    void* data) {
+    sqfs_err err = SQFS_OK;
+    sqfs_traverse trv;
+
+    if ((err = sqfs_traverse_open(&trv, fs, sqfs_inode_root(fs)))) {
+        fprintf(stderr, "sqfs_traverse_open error\n");
+        return false;
+    }
+
+    bool rv = true;
+
+    while (sqfs_traverse_next(&trv, &err)) {
+        if (trv.dir_end)
+            continue;
+
+        size_t depth = 0;
+        const char* name = trv.path;
+        for (const char* p = trv.path; *p != '\0'; p++) {
+            if (*p == '/') {
+                depth++;
+                name = p + 1;
+            }
+        }
+
+        const bool matches = pattern_set == NULL || extract_pattern_set_matches(pattern_set, trv.path);
+
+        if (!matches) {
+            if (!sqfs_dentry_is_dir(&trv.entry))
+                continue;
+
+            if (!extract_pattern_set_may_match_below(pattern_set, trv.path, depth)) {
+                // skip the entire subtree
+                if ((err = sqfs_traverse_prune(&trv)))
+                    break;
+                continue;
+            }
+        }
+
+        if (!callback(data, trv.path, depth, name, trv.entry.inode, matches)) {
+            rv = false;
+            break;
+        }
+    }
+
+    if (err != SQFS_OK) {
+        fprintf(stderr, "sqfs_traverse_next error\n");
+        rv = false;
+    }
+    sqfs_traverse_close(&trv);
+
+    return rv;
+}
+
+bool extract_traverse_callback(void* data, const char* const path, const size_t depth, const char* const name, const sqfs_inode_id inode_id, const bool matches) {
+    struct extract_context* ctx = data;
+
+    // the stack must only contain the parents of the current entry
+    extract_dir_stack_truncate(&ctx->dirs, depth);
+
+    if (!matches) {
+        // only needed to get to matching entries, hence must not be created unless there are any
+        if (!extract_dir_stack_push(&ctx->dirs, name, false)) {
+            fprintf(stderr, "Failed allocating memory for directory stack\n");
+            return false;
+        }
+        return true;
+    }
+
+    // creating directories and symlinks, and reading the inodes of files
+    uint64_t lap_start = monotonic_time_ns();
+    const bool rv = extract_entry(ctx, path, depth, name, inode_id);
+    extract_stats_lap(&ctx->stats.metadata_ns, &lap_start);
+
+    return rv;
+}
+
+/* Extract all entries matching the patterns (or all entries, if pattern_set is NULL) by traversing the image */
+bool extract_traverse(struct extract_context* ctx, const struct extract_pattern_set* pattern_set) {
+    return traverse_image(ctx->fs, pattern_set, extract_traverse_callback, ctx);
+}
+
+/* Extract all entries below the directory dir_path by traversing just that directory
+ * The directory must have been extracted already, and be on top of the directory stack, i.e., dir_depth is the number
+ * of slashes in dir_path plus one. */
+bool extract_subtree(struct extract_context* ctx, const char* const dir_path, const size_t dir_depth, const sqfs_inode_id inode_id) {
+    sqfs_err err = SQFS_OK;
+    sqfs_traverse trv;
+
+    if ((err = sqfs_traverse_open(&trv, ctx->fs, inode_id))) {
+        fprintf(stderr, "sqfs_traverse_open error\n");
+        return false;
+    }
+
+    bool rv = true;
+
+    while (sqfs_traverse_next(&trv, &err)) {
+        if (trv.dir_end)
+            continue;
+
+        // the traversal's paths are relative to the directory
+        char path[PATH_MAX];
+        int length = snprintf(path, sizeof(path), "%s/%s", dir_path, trv.path);
+        if (length < 0 || (size_t) length >= sizeof(path)) {
+            fprintf(stderr, "Path too long: %s/%s\n", dir_path, trv.path);
+            rv = false;
+            break;
+        }
+
+        size_t depth = dir_depth;
+        const char* name = path + strlen(dir_path) + 1;
+        for (const char* p = name; *p != '\0'; p++) {
+            if (*p == '/') {
+                depth++;
+                name = p + 1;
+            }
+        }
+
+        if (!extract_traverse_callback(ctx, path, depth, name, trv.entry.inode, true)) {
+            rv = false;
+            break;
+        }
+    }
+
+    if (err != SQFS_OK) {
+        fprintf(stderr, "sqfs_traverse_next error\n");
+        rv = false;
+    }
+    sqfs_traverse_close(&trv);
+
+    return rv;
+}
+
+/* Check whether a pattern matches nothing but the path it spells out, i.e., contains no wildcards */
+bool is_literal_pattern(const char* const pattern) {
+    return strpbrk(pattern, "*?[\\") == NULL;
+}
+
+/* Normalize a path inside the image: remove leading slashes, empty and "." components, and resolve ".." components
+ * Returns false if the path would leave the image */
+bool normalize_image_path(const char* const path, char* normalized, const size_t normalized_size) {
+    size_t length = 0;
+    normalized[0] = '\0';
+
+    const char* component = path;
+    while (*component != '\0') {
+        const char* end = strchr(component, '/');
+        size_t component_length = end == NULL ? strlen(component) : (size_t) (end - component);
+
+        if (component_length == 0 || (component_length == 1 && component[0] == '.')) {
+            // nothing to do
+        } else if (component_length == 2 && component[0] == '.' && component[1] == '.') {
+            if (length == 0)
+                return false;
+            char* parent_end = strrchr(normalized, '/');
+            length = parent_end == NULL ? 0 : (size_t) (parent_end - normalized);
+            normalized[length] = '\0';
+        } else {
+            if (length + component_length + 2 > normalized_size)
+                return false;
+            if (length > 0)
+                normalized[length++] = '/';
+            memcpy(normalized + length, component, component_length);
+            length += component_length;
+            normalized[length] = '\0';
+        }
+
+        component += component_length;
+        while (*component == '/')
+            component++;
+    }
+
+    return true;
+}
+
+/* Look up a normalized path in the image using the directory indices rather than traversing the image
+ * Symlinks are not followed, neither as the last nor as intermediate components, just like when traversing */
+bool lookup_image_path(sqfs* fs, const char* const path, sqfs_inode_id* inode_id, sqfs_inode* inode, bool* found) {
+    *found = false;
+    *inode_id = sqfs_inode_root(fs);
+    if (sqfs_inode_get(fs, inode, *inode_id))
+        return false;
+
+    const char* component = path;
+    while (*component != '\0') {
+        const char* end = strchr(component, '/');
+        size_t component_length = end == NULL ? strlen(component) : (size_t) (end - component);
+
+        if (inode->base.inode_type != SQUASHFS_DIR_TYPE && inode->base.inode_type != SQUASHFS_LDIR_TYPE)
+            return true;
+
+        char name_buffer[SQUASHFS_NAME_LEN + 1];
+        sqfs_dir_entry entry;
+        sqfs_dentry_init(&entry, name_buffer);
+
+        bool component_found;
+        if (sqfs_dir_lookup(fs, inode, component, component_length, &entry, &component_found))
+            return false;
+        if (!component_found)
+            return true;
+
+        *inode_id = sqfs_dentry_inode(&entry);
+        if (sqfs_inode_get(fs, inode, *inode_id))
+            return false;
+
+        component += component_length;
+        if (*component == '/')
+            component++;
+    }
+
+    *found = true;
+    return true;
+}
+
+/* Resolve a path in the image the way the kernel would resolve it in the mounted image, following symlinks in all of
+ * its components
+ * Symlinks with absolute targets point outside of the image, paths containing them are treated as not found. */
+bool resolve_image_path(sqfs* fs, const char* const path, sqfs_inode_id* inode_id, sqfs_inode* inode, bool* found) {
+    const int max_symlink_hops = 40;
+
+    *found = false;
+
+    char current[PATH_MAX];
+    if (!normalize_image_path(path, current, sizeof(current)))
+        return true;
+
+    for (int hops = 0; hops <= max_symlink_hops; hops++) {
+        *inode_id = sqfs_inode_root(fs);
+        if (sqfs_inode_get(fs, inode, *inode_id))
+            return false;
+
+        bool followed_symlink = false;
+
+        const char* component = current;
+        while (*component != '\0') {
+            const char* end = strchr(component, '/');
+            size_t component_length = end == NULL ? strlen(component) : (size_t) (end - component);
+            end = component + component_length;
+
+            if (inode->base.inode_type != SQUASHFS_DIR_TYPE && inode->base.inode_type != SQUASHFS_LDIR_TYPE)
+                return true;
+
+            char name_buffer[SQUASHFS_NAME_LEN + 1];
+            sqfs_dir_entry entry;
+            sqfs_dentry_init(&entry, name_buffer);
+
+            bool component_found;
+            if (sqfs_dir_lookup(fs, inode, component, component_length, &entry, &component_found))
+                return false;
+            if (!component_found)
+                return true;
+
+            *inode_id = sqfs_dentry_inode(&entry);
+            if (sqfs_inode_get(fs, inode, *inode_id))
+                return false;
+
+            if (inode->base.inode_type == SQUASHFS_SYMLINK_TYPE || inode->base.inode_type == SQUASHFS_LSYMLINK_TYPE) {
+                size_t size;
+                sqfs_readlink(fs, inode, NULL, &size);
+                char target[size];
+                if (sqfs_readlink(fs, inode, target, &size))
+                    return false;
+                if (target[0] == '/')
+                    return true;
+
+                // replace the symlink with its target, and start over
+                char joined[PATH_MAX];
+                int length = snprintf(joined, sizeof(joined), "%.*s%s%s", (int) (component - current), current, target, end);
+                if (length < 0 || (size_t) length >= sizeof(joined) || !normalize_image_path(joined, current, sizeof(current)))
+                    return true;
+
+                followed_symlink = true;
+                break;
+            }
+
+            component = end;
+            if (*component == '/')
+                component++;
+        }
+
+        if (!followed_symlink) {
+            *found = true;
+            return true;
+        }
+    }
+
+    // too many levels of symbolic links
+    return true;
+}
+
+/* Check whether path (relative to the root of the image) lies inside the directory dir_path */
+bool image_path_is_below(const char* const path, const char* const dir_path) {
+    const size_t length = strlen(dir_path);
+    return strncmp(path, dir_path, length) == 0 && path[length] == '/';
+}
+
+/* Extract the entries named by literal patterns by looking them up directly, which costs O(path depth) rather than
+ * O(image size)
+ * Symlinks pointing to other entries in the image (most notably .DirIcon) are followed, and their targets extracted as
+ * well. Directories, whether named directly or the target of a symlink, are extracted along with their contents by
+ * traversing just them. If a pattern names the root of the image, *needs_traversal is set and nothing is extracted. */
+bool extract_literal_paths(struct extract_context* ctx, char* const* const patterns, bool* needs_traversal) {
+    const int max_symlink_hops = 8;
+
+    *needs_traversal = false;
+
+    size_t count = 0;
+    for (char* const* pattern = patterns; *pattern != NULL; pattern++)
+        count++;
+
+    // the directly named paths, plus all symlink targets
+    size_t capacity = count * (max_symlink_hops + 1);
+    const char** paths = malloc(capacity * sizeof(char*));
+    sqfs_inode_id* inode_ids = malloc(capacity * sizeof(sqfs_inode_id));
+    bool* directories = malloc(capacity * sizeof(bool));
+    struct string_arena paths_arena;
+    memset(&paths_arena, 0, sizeof(paths_arena));
+
+    if (paths == NULL || inode_ids == NULL || directories == NULL) {
+        free(paths);
+        free(inode_ids);
+        free(directories);
+        fprintf(stderr, "Failed allocating memory for paths\n");
+        return false;
+    }
+
+    bool rv = true;
+    size_t resolved = 0;
+
+    for (size_t i = 0; rv && !*needs_traversal && i < count; i++) {
+        char path[PATH_MAX];
+        if (!normalize_image_path(patterns[i], path, sizeof(path)) || path[0] == '\0') {
+            // matches the entire image, or nothing at all
+            *needs_traversal = true;
+            break;
+        }
+
+        for (int hops = 0; hops <= max_symlink_hops; hops++) {
+            sqfs_inode_id inode_id;
+            sqfs_inode inode;
+            bool found;
+            if (!lookup_image_path(ctx->fs, path, &inode_id, &inode, &found)) {
+                fprintf(stderr, "Failed to look up %s in squashfs image\n", path);
+                rv = false;
+                break;
+            }
+
+            if (!found)
+                break;
+
+            bool duplicate = false;
+            for (size_t j = 0; j < resolved; j++) {
+                if (strcmp(paths[j], path) == 0)
+                    duplicate = true;
+            }
+            if (duplicate)
+                break;
+
+            paths[resolved] = string_arena_strdup(&paths_arena, path);
+            if (paths[resolved] == NULL) {
+                fprintf(stderr, "Failed allocating memory for paths\n");
+                rv = false;
+                break;
+            }
+            inode_ids[resolved] = inode_id;
+            directories[resolved] = inode.base.inode_type == SQUASHFS_DIR_TYPE || inode.base.inode_type == SQUASHFS_LDIR_TYPE;
+            resolved++;
+
+            if (inode.base.inode_type != SQUASHFS_SYMLINK_TYPE && inode.base.inode_type != SQUASHFS_LSYMLINK_TYPE)
+                break;
+
+            // follow relative symlinks, absolute ones point outside the image
+            size_t size;
+            sqfs_readlink(ctx->fs, &inode, NULL, &size);
+            char target[size];
+            if (sqfs_readlink(ctx->fs, &inode, target, &size) != 0 || target[0] == '/')
+                break;
+
+            char joined[PATH_MAX];
+            char* last_slash = strrchr(path, '/');
+            int length;
+            if (last_slash == NULL) {
+                length = snprintf(joined, sizeof(joined), "%s", target);
+            } else {
+                *last_slash = '\0';
+                length = snprintf(joined, sizeof(joined), "%s/%s", path, target);
+            }
+            if (length < 0 || (size_t) length >= sizeof(joined) || !normalize_image_path(joined, path, sizeof(path)) || path[0] == '\0')
+                break;
+        }
+    }
+
+    for (size_t i = 0; rv && !*needs_traversal && i < resolved; i++) {
+        // entries inside directories which are extracted in their entirety must not be extracted twice
+        bool below_directory = false;
+        for (size_t j = 0; j < resolved; j++) {
+            if (directories[j] && image_path_is_below(paths[i], paths[j]))
+                below_directory = true;
+        }
+        if (below_directory)
+            continue;
+
+        // set up the stack with the entry's parents, which will be created as needed
+        extract_dir_stack_truncate(&ctx->dirs, 0);
+
+        size_t depth = 0;
+        const char* name = paths[i];
+        for (const char* p = paths[i]; *p != '\0'; p++) {
+            if (*p == '/') {
+                char parent_name[p - name + 1];
+                memcpy(parent_name, name, p - name);
+                parent_name[p - name] = '\0';
+
+                if (!extract_dir_stack_push(&ctx->dirs, parent_name, false)) {
+                    fprintf(stderr, "Failed allocating memory for directory stack\n");
+                    rv = false;
+                }
+                depth++;
+                name = p + 1;
+            }
+        }
+
+        if (rv) {
+            uint64_t lap_start = monotonic_time_ns();
+            rv = extract_entry(ctx, paths[i], depth, name, inode_ids[i]);
+            extract_stats_lap(&ctx->stats.metadata_ns, &lap_start);
+        }
+
+        // extract_entry has pushed the directory onto the stack
+        if (rv && directories[i])
+            rv = extract_subtree(ctx, paths[i], depth + 1, inode_ids[i]);
+    }
+
+    free(paths);
+    free(inode_ids);
+    free(directories);
+    string_arena_free(&paths_arena);
+
+    return rv;
+}
+
+/* Make sure the file system the files are extracted to has enough space left, so that extraction fails right away
+ * rather than after filling up the disk
+ * Files which exist already are overwritten, freeing their space. As checking them all costs a syscall per file, they
+ * are only taken into account if the space left is not sufficient otherwise. */
+bool check_free_space(const struct extract_queue* queue, const uint64_t required_size) {
+    struct statvfs fs_stat;
+    if (fstatvfs(queue->root_fd, &fs_stat) != 0) {
+        // can't tell, so just go ahead
+        return true;
+    }
+
+    uint64_t available = (uint64_t) fs_stat.f_bavail * fs_stat.f_frsize;
+    if (available >= required_size)
+        return true;
+
+    for (size_t i = 0; i < queue->jobs_count && available < required_size; i++) {
+        struct stat st;
+        if (fstatat(queue->jobs[i].dir_fd, queue->jobs[i].name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode))
+            available += (uint64_t) st.st_blocks * 512;
+    }
+
+    if (available >= required_size)
+        return true;
+
+    fprintf(stderr, "Not enough space left to extract to %s: %" PRIu64 " MiB required, %" PRIu64 " MiB available\n",
+        queue->prefix, required_size / (1024 * 1024), available / (1024 * 1024));
+    return false;
+}
+
+/* Implementation of extract_appimage, prefix must end with a slash */
+bool extract_appimage_to_prefix(const char* const appimage_path, const char* const prefix, char* const* const patterns, const bool overwrite, const bool verbose, struct extract_stats* stats) {
+    const uint64_t start = monotonic_time_ns();
+    sqfs fs;
+
+    if (access(prefix, F_OK) == -1) {
+        if (mkdir_p(prefix) == -1) {
+            perror("mkdir_p error");
+            return false;
+        }
+    }
+
+    struct extract_context ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.fs = &fs;
+    ctx.prefix = prefix;
+    ctx.verbose = verbose;
+    extract_stats_init(&ctx.stats);
+
+    // everything is created relative to this directory and its subdirectories' fds
+    ctx.dirs.root_fd = open(prefix, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (ctx.dirs.root_fd == -1) {
+        fprintf(stderr, "Failed to open %s: %s\n", prefix, strerror(errno));
+        return false;
+    }
+
+    if (sqfs_open_image(&fs, appimage_path, (size_t) fs_offset)) {
+        fprintf(stderr, "Failed to open squashfs image\n");
+        close(ctx.dirs.root_fd);
+        return false;
+    };
+
+    ctx.queue.appimage_path = appimage_path;
+    ctx.queue.prefix = prefix;
+    ctx.queue.root_fd = ctx.dirs.root_fd;
+    ctx.queue.dir_fds_limit = extract_dir_fds_limit();
+    ctx.queue.overwrite = overwrite;
+    ctx.queue.stats = &ctx.stats;
+
+    // every shard must be able to hold at least one block, or nothing would ever be cached
+    const size_t block_cache_budget = block_cache_budget_from_env();
+    if (block_cache_budget >= BLOCK_CACHE_SHARDS * (size_t) fs.sb.block_size) {
+        block_cache_init(&ctx.queue.block_cache, block_cache_budget);
+        ctx.queue.fragment_cache = &ctx.queue.block_cache;
+    }
+    pthread_mutex_init(&ctx.queue.mutex, NULL);
+
+    bool rv = true;
+
+    // patterns without wildcards can be looked up directly
+    bool needs_traversal = true;
+    if (patterns != NULL && patterns[0] != NULL) {
+        bool all_literal = true;
+        for (char* const* pattern = patterns; *pattern != NULL; pattern++) {
+            if (!is_literal_pattern(*pattern))
+                all_literal = false;
+        }
+
+        if (all_literal)
+            rv = extract_literal_paths(&ctx, patterns, &needs_traversal);
+    }
+
+    if (rv && needs_traversal) {
+        if (patterns == NULL) {
+            rv = extract_traverse(&ctx, NULL);
+        } else {
+            struct extract_pattern_set pattern_set;
+            if (!extract_pattern_set_init(&pattern_set, patterns)) {
+                fprintf(stderr, "Failed allocating memory for patterns\n");
+                rv = false;
+            } else {
+                rv = extract_traverse(&ctx, &pattern_set);
+            }
+            extract_pattern_set_free(&pattern_set);
+        }
+    }
+
+    sqfs_fd_close(fs.fd);
+
+    extract_dir_stack_truncate(&ctx.dirs, 0);
+    free(ctx.dirs.dirs);
+
+    if (rv)
+        rv = check_free_space(&ctx.queue, ctx.required_size);
+
+    if (rv && ctx.queue.jobs_count > 1)
+        qsort(ctx.queue.jobs, ctx.queue.jobs_count, sizeof(struct extract_job), extract_job_compare);
+
+    if (rv)
+        rv = run_extract_workers(&ctx.queue, extract_threads_from_env());
+
+    for (size_t i = 0; i < ctx.queue.dir_fds_count; i++)
+        close(ctx.queue.dir_fds[i]);
+    free(ctx.queue.dir_fds);
+
+    if (ctx.queue.fragment_cache != NULL) {
+        block_cache_counters(ctx.queue.fragment_cache, &ctx.stats.fragment_cache_hits, &ctx.stats.fragment_cache_misses,
+                             &ctx.stats.fragment_cache_evictions);
+        block_cache_free(ctx.queue.fragment_cache);
+    }
+
+    // hardlinks can only be created once the files they point to exist
+    uint64_t lap_start = monotonic_time_ns();
+    for (size_t i = 0; rv && i < ctx.links_count; i++) {
+        unlinkat(ctx.dirs.root_fd, ctx.links[i].path, 0);
+        if (linkat(ctx.dirs.root_fd, ctx.links[i].target, ctx.dirs.root_fd, ctx.links[i].path, 0) == -1) {
+            fprintf(stderr, "Couldn't create hardlink from \"%s%s\" to \"%s%s\": %s\n",
+                prefix, ctx.links[i].path, prefix, ctx.links[i].target, strerror(errno));
+            rv = false;
+        }
+    }
+    extract_stats_lap(&ctx.stats.metadata_ns, &lap_start);
+
+    close(ctx.dirs.root_fd);
+
+    if (stats != NULL) {
+        *stats = ctx.stats;
+        stats->total_ns = monotonic_time_ns() - start;
+
+        // the paths are freed along with the context
+        for (size_t i = 0; i < stats->slowest_count; i++)
+            stats->slowest[i].path = strdup(stats->slowest[i].path);
+    }
+
+    free(ctx.links);
+    free(ctx.queue.jobs);
+    pthread_mutex_destroy(&ctx.queue.mutex);
+
+    hardlink_map_free(&ctx.created_inodes);
+    string_arena_free(&ctx.paths);
+
+    return rv;
+}
+
+/* Extract the contents of the AppImage to _prefix
+ * If patterns is not NULL, only the entries matching any of the patterns in the NULL-terminated list are extracted
+ * If stats is not NULL, statistics about the extraction are stored in it, which must be freed with extract_stats_free */
+bool extract_appimage(const char* const appimage_path, const char* const _prefix, char* const* const patterns, const bool overwrite, const bool verbose, struct extract_stats* stats) {
+    // local copy we can modify safely
+    // allocate 1 more byte than we would need so we can add a trailing slash if there is none yet
+    char* prefix = malloc(strlen(_prefix) + 2);
+    strcpy(prefix, _prefix);
+
+    // sanitize prefix
+    if (prefix[strlen(prefix) - 1] != '/')
+        strcat(prefix, "/");
+
+    const bool rv = extract_appimage_to_prefix(appimage_path, prefix, patterns, overwrite, verbose, stats);
+
+    free(prefix);
+
+    return rv;
+}
+
+/* Writer for POSIX (pax) tar archives, used to stream the contents of the image
+ * Plain ustar headers are used whenever possible, pax extended headers are only added for entries whose path, link
+ * target, size or owner don't fit into them. */
+#define TAR_BLOCK_SIZE 512
+
+struct tar_header {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char checksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char padding[12];
+};
+
+struct tar_writer {
+    sqfs* fs;
+    int fd;
+    // the path the first occurrence of each inode with more than one link has been archived as
+    struct hardlink_map archived_inodes;
+    struct string_arena paths;
+    // pax extended header records for the current entry
+    char* records;
+    size_t records_size;
+    size_t records_capacity;
+};
+
+/* Write value as a zero-padded octal number, which must leave room for the terminating NUL
+ * Returns false if the value doesn't fit */
+bool tar_octal(char* const field, const size_t field_size, const uint64_t value) {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%0*" PRIo64, (int) (field_size - 1), value);
+    if (strlen(buffer) > field_size - 1)
+        return false;
+    memcpy(field, buffer, field_size);
+    return true;
+}
+
+/* Append a "<length> <key>=<value>\n" record to the pax extended header of the current entry */
+bool tar_add_record(struct tar_writer* writer, const char* const key, const char* const value) {
+    // the length includes the digits of the length itself, besides the space, the equals sign and the newline
+    size_t length = strlen(key) + strlen(value) + 3;
+    size_t digits = (size_t) snprintf(NULL, 0, "%zu", length);
+    if ((size_t) snprintf(NULL, 0, "%zu", length + digits) > digits)
+        digits++;
+    length += digits;
+
+    if (writer->records_size + length + 1 > writer->records_capacity) {
+        size_t capacity = writer->records_capacity == 0 ? 1024 : writer->records_capacity;
+        while (writer->records_size + length + 1 > capacity)
+            capacity *= 2;
+        char* records = realloc(writer->records, capacity);
+        if (records == NULL)
+            return false;
+        writer->records = records;
+        writer->records_capacity = capacity;
+    }
+
+    writer->records_size += sprintf(writer->records + writer->records_size, "%zu %s=%s\n", length, key, value);
+    return true;
+}
+
+bool tar_write_header(struct tar_writer* writer, struct tar_header* header) {
+    memcpy(header->magic, "ustar", 6);
+    memcpy(header->version, "00", 2);
+
+    // the checksum is calculated with the checksum field filled with spaces
+    memset(header->checksum, ' ', sizeof(header->checksum));
+    unsigned checksum = 0;
+    for (size_t i = 0; i < sizeof(*header); i++)
+        checksum += ((unsigned char*) header)[i];
+    snprintf(header->checksum, sizeof(header->checksum), "%06o", checksum);
+
+    return write_all(writer->fd, header, sizeof(*header));
+}
+
+/* Write the header(s) for an entry, preceded by a pax extended header if needed */
+bool tar_write_entry_header(struct tar_writer* writer, const char* const path, const struct stat* const st, const char typeflag, const char* const linkname) {
+    struct tar_header header;
+    memset(&header, 0, sizeof(header));
+
+    writer->records_size = 0;
+    bool rv = true;
+
+    if (strlen(path) < sizeof(header.name)) {
+        strcpy(header.name, path);
+    } else {
+        // truncated, extracting tools use the pax record instead
+        strncpy(header.name, path, sizeof(header.name));
+        rv = tar_add_record(writer, "path", path);
+    }
+
+    if (linkname != NULL) {
+        if (strlen(linkname) < sizeof(header.linkname)) {
+            strcpy(header.linkname, linkname);
+        } else {
+            strncpy(header.linkname, linkname, sizeof(header.linkname));
+            rv = rv && tar_add_record(writer, "linkpath", linkname);
+        }
+    }
+
+    const uint64_t size = typeflag == '0' ? (uint64_t) st->st_size : 0;
+
+    char number[32];
+    if (!tar_octal(header.size, sizeof(header.size), size)) {
+        sprintf(number, "%" PRIu64, size);
+        rv = rv && tar_add_record(writer, "size", number);
+    }
+    if (!tar_octal(header.uid, sizeof(header.uid), st->st_uid)) {
+        sprintf(number, "%u", (unsigned) st->st_uid);
+        rv = rv && tar_add_record(writer, "uid", number);
+    }
+    if (!tar_octal(header.gid, sizeof(header.gid), st->st_gid)) {
+        sprintf(number, "%u", (unsigned) st->st_gid);
+        rv = rv && tar_add_record(writer, "gid", number);
+    }
+
+    tar_octal(header.mode, sizeof(header.mode), st->st_mode & 07777);
+    tar_octal(header.mtime, sizeof(header.mtime), (uint64_t) st->st_mtime);
+    header.typeflag = typeflag;
+
+    if (typeflag == '3' || typeflag == '4') {
+        tar_octal(header.devmajor, sizeof(header.devmajor), major(st->st_rdev));
+        tar_octal(header.devminor, sizeof(header.devminor), minor(st->st_rdev));
+    }
+
+    if (!rv) {
+        fprintf(stderr, "Failed allocating memory for tar header of %s\n", path);
+        return false;
+    }
+
+    if (writer->records_size > 0) {
+        struct tar_header pax_header;
+        memset(&pax_header, 0, sizeof(pax_header));
+        strcpy(pax_header.name, "PaxHeader");
+        tar_octal(pax_header.mode, sizeof(pax_header.mode), 0644);
+        tar_octal(pax_header.uid, sizeof(pax_header.uid), 0);
+        tar_octal(pax_header.gid, sizeof(pax_header.gid), 0);
+        tar_octal(pax_header.size, sizeof(pax_header.size), writer->records_size);
+        tar_octal(pax_header.mtime, sizeof(pax_header.mtime), (uint64_t) st->st_mtime);
+        pax_header.typeflag = 'x';
+
+        const size_t padding = (TAR_BLOCK_SIZE - writer->records_size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+        if (!tar_write_header(writer, &pax_header) ||
+            !write_all(writer->fd, writer->records, writer->records_size) ||
+            !write_zeroes(writer->fd, padding))
+            return false;
+    }
+
+    return tar_write_header(writer, &header);
+}
+
+bool tar_write_file_data(struct tar_writer* writer, sqfs_inode* inode, const char* const path) {
+    bool rv = true;
+
+    struct file_block_stream stream;
+    file_block_stream_init(&stream, writer->fs, inode);
+
+    const void* data;
+    size_t size;
+    sqfs_err err = SQFS_OK;
+    while (rv && file_block_stream_next(&stream, &data, &size, &err)) {
+        if (data == NULL)
+            rv = write_zeroes(writer->fd, size);
+        else
+            rv = write_all(writer->fd, data, size);
+    }
+    file_block_stream_close(&stream);
+
+    if (err != SQFS_OK) {
+        fprintf(stderr, "Failed to read data of %s from squashfs image\n", path);
+        return false;
+    }
+
+    const size_t padding = (TAR_BLOCK_SIZE - inode->xtra.reg.file_size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+    return rv && write_zeroes(writer->fd, padding);
+}
+
+bool tar_traverse_callback(void* data, const char* const path, const size_t depth, const char* const name, const sqfs_inode_id inode_id, const bool matches) {
+    struct tar_writer* writer = data;
+    (void) depth;
+    (void) name;
+
+    // parent directories of matching entries are created by tar implicitly
+    if (!matches)
+        return true;
+
+    sqfs_inode inode;
+    struct stat st;
+    if (sqfs_inode_get(writer->fs, &inode, inode_id) || private_sqfs_stat(writer->fs, &inode, &st)) {
+        fprintf(stderr, "sqfs_inode_get error\n");
+        return false;
+    }
+
+    bool rv;
+    if (S_ISDIR(st.st_mode)) {
+        char dir_path[strlen(path) + 2];
+        sprintf(dir_path, "%s/", path);
+        rv = tar_write_entry_header(writer, dir_path, &st, '5', NULL);
+    } else if (S_ISREG(st.st_mode)) {
+        const char* const target = inode.nlink > 1 ? hardlink_map_get(&writer->archived_inodes, inode.base.inode_number) : NULL;
+        if (target != NULL)
+            return tar_write_entry_header(writer, path, &st, '1', target);
+
+        if (inode.nlink > 1) {
+            const char* const archived_path = string_arena_strdup(&writer->paths, path);
+            if (archived_path == NULL || !hardlink_map_put(&writer->archived_inodes, inode.base.inode_number, archived_path)) {
+                fprintf(stderr, "Failed allocating memory to track hardlinks\n");
+                return false;
+            }
+        }
+
+        rv = tar_write_entry_header(writer, path, &st, '0', NULL) && tar_write_file_data(writer, &inode, path);
+    } else if (S_ISLNK(st.st_mode)) {
+        size_t size;
+        sqfs_readlink(writer->fs, &inode, NULL, &size);
+        char target[size];
+        if (sqfs_readlink(writer->fs, &inode, target, &size)) {
+            fprintf(stderr, "sqfs_readlink error\n");
+            return false;
+        }
+        rv = tar_write_entry_header(writer, path, &st, '2', target);
+    } else if (S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode) || S_ISFIFO(st.st_mode)) {
+        rv = tar_write_entry_header(writer, path, &st, S_ISCHR(st.st_mode) ? '3' : (S_ISBLK(st.st_mode) ? '4' : '6'), NULL);
+    } else {
+        fprintf(stderr, "Skipping %s, sockets can't be archived\n", path);
+        return true;
+    }
+
+    if (!rv)
+        fprintf(stderr, "Failed to write %s to archive: %s\n", path, strerror(errno));
+
+    return rv;
+}
+
+/* Get the patterns passed to an --appimage-extract* or --appimage-list option: all arguments starting at argv[first],
+ * or @<file> to read them from a file, one per line
+ * *patterns is set to NULL if there are none. If they have been read from a file, *pattern_file_patterns is set, and
+ * must be freed with free_patterns. Returns false if the file can't be read. */
+bool patterns_from_args(const int argc, char** argv, const int first, char*** patterns, char*** pattern_file_patterns) {
+    *patterns = NULL;
+    *pattern_file_patterns = NULL;
+
+    if (argc == first + 1 && argv[first][0] == '@') {
+        *pattern_file_patterns = read_pattern_file(argv[first] + 1);
+        if (*pattern_file_patterns == NULL)
+            return false;
+        *patterns = *pattern_file_patterns;
+    } else if (argc > first) {
+        // argv is NULL-terminated
+        *patterns = &argv[first];
+    }
+
+    return true;
+}
+
+/* Write a tar archive of the contents of the AppImage to fd, without extracting anything to disk
+ * If patterns is not NULL, only the entries matching any of the patterns in the NULL-terminated list are archived */
+bool extract_appimage_tar(const char* const appimage_path, char* const* const patterns, const int fd) {
+    sqfs fs;
+    if (sqfs_open_image(&fs, appimage_path, (size_t) fs_offset)) {
+        fprintf(stderr, "Failed to open squashfs image\n");
+        return false;
+    }
+
+    struct tar_writer writer;
+    memset(&writer, 0, sizeof(writer));
+    writer.fs = &fs;
+    writer.fd = fd;
+
+    bool rv;
+    if (patterns == NULL) {
+        rv = traverse_image(&fs, NULL, tar_traverse_callback, &writer);
+    } else {
+        struct extract_pattern_set pattern_set;
+        if (!extract_pattern_set_init(&pattern_set, patterns)) {
+            fprintf(stderr, "Failed allocating memory for patterns\n");
+            rv = false;
+        } else {
+            rv = traverse_image(&fs, &pattern_set, tar_traverse_callback, &writer);
+        }
+        extract_pattern_set_free(&pattern_set);
+    }
+
+    // the end of the archive is marked by two empty blocks
+    if (rv && !write_zeroes(writer.fd, 2 * TAR_BLOCK_SIZE)) {
+        fprintf(stderr, "Failed to write archive: %s\n", strerror(errno));
+        rv = false;
+    }
+
+    hardlink_map_free(&writer.archived_inodes);
+    string_arena_free(&writer.paths);
+    free(writer.records);
+
+    sqfs_destroy(&fs);
+    sqfs_fd_close(fs.fd);
+
+    return rv;
+}
+
+/* Print a string as a JSON string literal, escaping quotes, backslashes and control characters */
+void print_json_string(FILE* const stream, const char* const str) {
+    fputc('"', stream);
+    for (const unsigned char* p = (const unsigned char*) str; *p != '\0'; p++) {
+        if (*p == '"' || *p == '\\')
+            fprintf(stream, "\\%c", *p);
+        else if (*p < 0x20)
+            fprintf(stream, "\\u%04x", *p);
+        else
+            fputc(*p, stream);
+    }
+    fputc('"', stream);
+}
+
+/* Print the statistics of an extraction as a single line of JSON, times are in milliseconds */
+void print_extract_stats(FILE* const stream, const struct extract_stats* const stats) {
+    const double ns_per_ms = 1000000.0;
+
+    fprintf(stream, "{\"bytes_in\":%" PRIu64 ",\"bytes_out\":%" PRIu64 ",\"fragment_bytes\":%" PRIu64,
+        stats->bytes_in, stats->bytes_out, stats->fragment_bytes);
+    fprintf(stream, ",\"files\":{\"regular\":%zu,\"hardlink\":%zu,\"directory\":%zu,\"symlink\":%zu,\"skipped\":%zu}",
+        stats->regular_files, stats->hardlinks, stats->directories, stats->symlinks, stats->skipped);
+    fprintf(stream, ",\"time_ms\":{\"total\":%.3f,\"read\":%.3f,\"write\":%.3f,\"metadata\":%.3f}",
+        stats->total_ns / ns_per_ms, stats->read_ns / ns_per_ms, stats->write_ns / ns_per_ms, stats->metadata_ns / ns_per_ms);
+    const size_t fragment_lookups = stats->fragment_cache_hits + stats->fragment_cache_misses;
+    fprintf(stream, ",\"fragment_cache\":{\"hits\":%zu,\"misses\":%zu,\"evictions\":%zu,\"hit_rate\":%.3f}",
+        stats->fragment_cache_hits, stats->fragment_cache_misses, stats->fragment_cache_evictions,
+        fragment_lookups == 0 ? 0.0 : (double) stats->fragment_cache_hits / fragment_lookups);
+
+    fprintf(stream, ",\"slowest_files\":[");
+    for (size_t i = 0; i < stats->slowest_count; i++) {
+        fprintf(stream, "%s{\"path\":", i == 0 ? "" : ",");
+        print_json_string(stream, stats->slowest[i].path);
+        fprintf(stream, ",\"time_ms\":%.3f}", stats->slowest[i].ns / ns_per_ms);
+    }
+    fprintf(stream, "]}\n");
+}
+
+struct list_context {
+    sqfs* fs;
+    bool json;
+    bool compressed_size;
+};
+
+/* Sum up the sizes of a file's data blocks as stored in the image, without reading any of them
+ * Tails stored in fragments are shared with other files, and hence not included */
+bool file_compressed_size(sqfs* fs, sqfs_inode* inode, uint64_t* compressed_size) {
+    *compressed_size = 0;
+
+    sqfs_blocklist blocklist;
+    sqfs_blocklist_init(fs, inode, &blocklist);
+
+    while (blocklist.remain > 0) {
+        if (sqfs_blocklist_next(&blocklist))
+            return false;
+
+        bool compressed;
+        uint32_t stored_size;
+        sqfs_data_header(blocklist.header, &compressed, &stored_size);
+        *compressed_size += stored_size;
+    }
+
+    return true;
+}
+
+bool list_traverse_callback(void* data, const char* const path, const size_t depth, const char* const name, const sqfs_inode_id inode_id, const bool matches) {
+    struct list_context* ctx = data;
+    (void) depth;
+    (void) name;
+
+    if (!matches)
+        return true;
+
+    sqfs_inode inode;
+    struct stat st;
+    if (sqfs_inode_get(ctx->fs, &inode, inode_id) || private_sqfs_stat(ctx->fs, &inode, &st)) {
+        fprintf(stderr, "sqfs_inode_get error\n");
+        return false;
+    }
+
+    const char* type;
+    char type_char;
+    switch (st.st_mode & S_IFMT) {
+        case S_IFDIR: type = "directory"; type_char = 'd'; break;
+        case S_IFREG: type = "file"; type_char = '-'; break;
+        case S_IFLNK: type = "symlink"; type_char = 'l'; break;
+        case S_IFCHR: type = "char_device"; type_char = 'c'; break;
+        case S_IFBLK: type = "block_device"; type_char = 'b'; break;
+        case S_IFIFO: type = "fifo"; type_char = 'p'; break;
+        default: type = "socket"; type_char = 's'; break;
+    }
+
+    uint64_t compressed_size = 0;
+    if (ctx->compressed_size && S_ISREG(st.st_mode) && !file_compressed_size(ctx->fs, &inode, &compressed_size)) {
+        fprintf(stderr, "sqfs_blocklist_next error\n");
+        return false;
+    }
+
+    char* target = NULL;
+    if (S_ISLNK(st.st_mode)) {
+        size_t size;
+        sqfs_readlink(ctx->fs, &inode, NULL, &size);
+        target = malloc(size);
+        if (target == NULL || sqfs_readlink(ctx->fs, &inode, target, &size)) {
+            fprintf(stderr, "sqfs_readlink error\n");
+            free(target);
+            return false;
+        }
+    }
+
+    if (ctx->json) {
+        printf("{\"path\":");
+        print_json_string(stdout, path);
+        printf(",\"type\":\"%s\",\"mode\":\"%04o\",\"size\":%" PRIu64, type, (unsigned) (st.st_mode & 07777), (uint64_t) st.st_size);
+        if (ctx->compressed_size && S_ISREG(st.st_mode))
+            printf(",\"compressed_size\":%" PRIu64, compressed_size);
+        if (target != NULL) {
+            printf(",\"target\":");
+            print_json_string(stdout, target);
+        }
+        printf("}\n");
+    } else {
+        // same format as ls -l
+        const char* const permissions = "rwxrwxrwx";
+        char mode[11];
+        mode[0] = type_char;
+        for (int i = 0; i < 9; i++)
+            mode[i + 1] = (st.st_mode & (0400 >> i)) ? permissions[i] : '-';
+        mode[10] = '\0';
+        if (st.st_mode & S_ISUID)
+            mode[3] = (st.st_mode & S_IXUSR) ? 's' : 'S';
+        if (st.st_mode & S_ISGID)
+            mode[6] = (st.st_mode & S_IXGRP) ? 's' : 'S';
+        if (st.st_mode & S_ISVTX)
+            mode[9] = (st.st_mode & S_IXOTH) ? 't' : 'T';
+
+        printf("%s %12" PRIu64, mode, (uint64_t) st.st_size);
+        if (ctx->compressed_size)
+            printf(" %12" PRIu64, compressed_size);
+        printf(" %s", path);
+        if (target != NULL)
+            printf(" -> %s", target);
+        printf("\n");
+    }
+
+    free(target);
+    return true;
+}
+
+/* List the contents of the AppImage, reading nothing but the metadata from the image
+ * If patterns is not NULL, only the entries matching any of the patterns in the NULL-terminated list are listed */
+bool list_appimage(const char* const appimage_path, char* const* const patterns, const bool json, const bool compressed_size) {
+    sqfs fs;
+    if (sqfs_open_image(&fs, appimage_path, (size_t) fs_offset)) {
+        fprintf(stderr, "Failed to open squashfs image\n");
+        return false;
+    }
+
+    struct list_context ctx;
+    ctx.fs = &fs;
+    ctx.json = json;
+    ctx.compressed_size = compressed_size;
+
+    bool rv;
+    if (patterns == NULL) {
+        rv = traverse_image(&fs, NULL, list_traverse_callback, &ctx);
+    } else {
+        struct extract_pattern_set pattern_set;
+        if (!extract_pattern_set_init(&pattern_set, patterns)) {
+            fprintf(stderr, "Failed allocating memory for patterns\n");
+            rv = false;
+        } else {
+            rv = traverse_image(&fs, &pattern_set, list_traverse_callback, &ctx);
+        }
+        extract_pattern_set_free(&pattern_set);
+    }
+
+    if (fflush(stdout) != 0) {
+        perror("Failed to write listing");
+        rv = false;
+    }
+
+    sqfs_destroy(&fs);
+    sqfs_fd_close(fs.fd);
+
+    return rv;
+}
+
+/* Write the contents of a single file in the AppImage to fd, following symlinks
+ * Blocks stored uncompressed are copied by the kernel (see copy_image_range) */
+bool cat_appimage_file(const char* const appimage_path, const char* const path, const int fd) {
+    sqfs fs;
+    if (sqfs_open_image(&fs, appimage_path, (size_t) fs_offset)) {
+        fprintf(stderr, "Failed to open squashfs image\n");
+        return false;
+    }
+
+    bool rv = true;
+
+    sqfs_inode_id inode_id;
+    sqfs_inode inode;
+    bool found;
+    if (!resolve_image_path(&fs, path, &inode_id, &inode, &found)) {
+        fprintf(stderr, "Failed to look up %s in squashfs image\n", path);
+        rv = false;
+    } else if (!found) {
+        fprintf(stderr, "%s: No such file in AppImage\n", path);
+        rv = false;
+    } else if (inode.base.inode_type != SQUASHFS_REG_TYPE && inode.base.inode_type != SQUASHFS_LREG_TYPE) {
+        fprintf(stderr, "%s: Not a regular file\n", path);
+        rv = false;
+    }
+
+    if (rv) {
+        struct file_block_stream stream;
+        file_block_stream_init(&stream, &fs, &inode);
+        stream.passthrough = true;
+
+        const void* data;
+        size_t size;
+        sqfs_err err = SQFS_OK;
+        while (rv && file_block_stream_next(&stream, &data, &size, &err)) {
+            if (stream.passthrough_offset != -1)
+                rv = copy_image_range(fs.fd, stream.passthrough_offset, fd, size);
+            else if (data == NULL)
+                rv = write_zeroes(fd, size);
+            else
+                rv = write_all(fd, data, size);
+
+            if (!rv)
+                fprintf(stderr, "Failed to write %s: %s\n", path, strerror(errno));
+        }
+        if (err != SQFS_OK) {
+            fprintf(stderr, "Failed to read data of %s from squashfs image\n", path);
+            rv = false;
+        }
+        file_block_stream_close(&stream);
+    }
+
+    sqfs_destroy(&fs);
+    sqfs_fd_close(fs.fd);
+
+    return rv;
+}
+
+int rm_recursive_callback(const char* path, const struct stat* stat, const int type, struct FTW* ftw) {
+    (void) stat;
+    (void) ftw;
+
+    switch (type) {
+        case FTW_NS:
+        case FTW_DNR:
+            fprintf(stderr, "%s: ftw error: %s\n",
+                path, strerror(errno));
+            return 1;
+
+        case FTW_D:
+            // ignore directories at first, will be handled by FTW_DP
+            break;
+
+        case FTW_F:
+        case FTW_SL:
+        case FTW_SLN:
+            if (remove(path) != 0) {
+                fprintf(stderr, "Failed to remove %s: %s\n", path, strerror(errno));
+                return false;
+            }
+            break;
+
+
+        case FTW_DP:
+            if (rmdir(path) != 0) {
+                fprintf(stderr, "Failed to remove directory %s: %s\n", path, strerror(errno));
+                return false;
+            }
+            break;
+
+        default:
+            fprintf(stderr, "Unexpected fts_info\n");
+            return 1;
+    }
+
+    return 0;
+};
+
+bool rm_recursive(const char* const path) {
+    // FTW_DEPTH: perform depth-first search to make sure files are deleted before the containing directories
+    // FTW_MOUNT: prevent deletion of files on other mounted filesystems
+    // FTW_PHYS: do not follow symlinks, but report symlinks as such; this way, the symlink targets, which might point
+    //           to locations outside path will not be deleted accidentally (attackers might abuse this)
+    int rv = nftw(path, &rm_recursive_callback, 0, FTW_DEPTH | FTW_MOUNT | FTW_PHYS);
+
+    return rv == 0;
+}
+
+/* Background cleanup for extract-and-run
+ * Deleting a large extracted tree can take seconds, which is added to every run of an application. Instead, the tree
+ * is renamed to a trash name next to it, and deleted by a detached process while the runtime exits right away.
+ * Trash directories are locked for as long as they're being deleted. Unlocked ones have been left behind by crashed
+ * or killed cleanup processes, and are deleted on the next launch. */
+#define TRASH_INFIX ".trash-"
+
+bool background_cleanup_enabled(void) {
+    return getenv("APPIMAGE_EXTRACT_AND_RUN_BACKGROUND_CLEANUP") != NULL;
+}
+
+/* Rename a directory without replacing an existing one at the new path */
+bool rename_noreplace(const char* const old_path, const char* const new_path) {
+#ifdef __NR_renameat2
+    // RENAME_NOREPLACE from <linux/fs.h>, which the C library doesn't provide on older systems
+    if (syscall(__NR_renameat2, AT_FDCWD, old_path, AT_FDCWD, new_path, 1 << 0) == 0)
+        return true;
+    if (errno != ENOSYS && errno != EINVAL)
+        return false;
+#endif
+
+    // kernel or filesystem without renameat2, the random name makes a collision unlikely in the first place
+    struct stat st;
+    if (lstat(new_path, &st) == 0) {
+        errno = EEXIST;
+        return false;
+    }
+
+    return rename(old_path, new_path) == 0;
+}
+
+/* Rename prefix to a unique trash name in the same directory
+ * Returns an fd holding an exclusive lock on the trash directory, or -1 on errors, in which case prefix is left as is */
+int move_to_trash(const char* const prefix, char** trash_path) {
+    // the lock moves along with the directory, so the trash directory is never unlocked while it's being deleted
+    int fd = open(prefix, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+
+    if (flock(fd, LOCK_EX) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    *trash_path = malloc(strlen(prefix) + strlen(TRASH_INFIX) + 9);
+
+    // the directory must not show up under a trash name before it is locked, otherwise stale trash reaping might pick
+    // it up, so rather than reserving a name with mkdtemp, the locked directory is renamed straight to a random name
+    uint64_t seed = monotonic_time_ns() ^ ((uint64_t) getpid() << 32);
+    for (int attempt = 0; attempt < 16; attempt++) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        sprintf(*trash_path, "%s" TRASH_INFIX "%08" PRIx32, prefix, (uint32_t) (seed >> 32));
+
+        if (rename_noreplace(prefix, *trash_path))
+            return fd;
+
+        if (errno != EEXIST && errno != ENOTEMPTY)
+            break;
+    }
+
+    free(*trash_path);
+    *trash_path = NULL;
+    close(fd);
+    return -1;
+}
+
+/* A directory being deleted by rm_recursive_parallel
+ * Directories are opened relative to their parent's fd, and removed relative to it, so that no path is ever resolved
+ * again while deleting; a component replaced by a symlink can't redirect the deletion elsewhere. */
+struct parallel_rm_dir {
+    struct parallel_rm_dir* parent;
+    // relative to the parent, NULL for the top directory
+    char* name;
+    // open while the directory is being read, and as long as it has subdirectories left
+    int fd;
+    // 1 while the directory hasn't been read yet, plus the number of subdirectories which haven't been removed yet
+    size_t pending;
+};
+
+struct parallel_rm {
+    dev_t dev;
+    // directories waiting to be read; handled last in, first out, which keeps the number of open fds low
+    struct parallel_rm_dir** queue;
+    size_t count;
+    size_t capacity;
+    int busy;
+    bool failed;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+/* Queue a subdirectory of parent; the caller must hold the mutex */
+bool parallel_rm_push(struct parallel_rm* const rm, struct parallel_rm_dir* const parent, const char* const name) {
+    if (rm->count == rm->capacity) {
+        size_t capacity = rm->capacity == 0 ? 64 : rm->capacity * 2;
+        struct parallel_rm_dir** queue = realloc(rm->queue, capacity * sizeof(struct parallel_rm_dir*));
+        if (queue == NULL)
+            return false;
+        rm->queue = queue;
+        rm->capacity = capacity;
+    }
+
+    struct parallel_rm_dir* dir = malloc(sizeof(struct parallel_rm_dir));
+    if (dir == NULL)
+        return false;
+
+    dir->name = strdup(name);
+    if (dir->name == NULL) {
+        free(dir);
+        return false;
+    }
+    dir->parent = parent;
+    dir->fd = -1;
+    dir->pending = 1;
+    parent->pending++;
+
+    rm->queue[rm->count++] = dir;
+    pthread_cond_signal(&rm->cond);
+    return true;
+}
+
+/* Mark one of the things a directory is waiting for as done, and remove the directory once it's empty
+ * Removing a directory may in turn complete its parent. The top directory is left to the caller. */
+void parallel_rm_complete(struct parallel_rm* const rm, struct parallel_rm_dir* dir) {
+    while (dir->parent != NULL) {
+        pthread_mutex_lock(&rm->mutex);
+        const bool done = --dir->pending == 0;
+        pthread_mutex_unlock(&rm->mutex);
+
+        if (!done)
+            return;
+
+        if (dir->fd != -1)
+            close(dir->fd);
+        if (unlinkat(dir->parent->fd, dir->name, AT_REMOVEDIR) != 0) {
+            pthread_mutex_lock(&rm->mutex);
+            rm->failed = true;
+            pthread_mutex_unlock(&rm->mutex);
+        }
+
+        struct parallel_rm_dir* parent = dir->parent;
+        free(dir->name);
+        free(dir);
+        dir = parent;
+    }
+
+    pthread_mutex_lock(&rm->mutex);
+    dir->pending--;
+    pthread_mutex_unlock(&rm->mutex);
+}
+
+/* Unlink everything but subdirectories in the given directory, and queue the subdirectories */
+bool parallel_rm_directory(struct parallel_rm* const rm, struct parallel_rm_dir* const dir) {
+    // symlinks are never followed, like in rm_recursive
+    if (dir->fd == -1)
+        dir->fd = openat(dir->parent->fd, dir->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (dir->fd == -1)
+        return false;
+
+    // the directory's own fd is needed for its subdirectories, readdir gets a copy
+    int read_fd = dup(dir->fd);
+    DIR* d = read_fd == -1 ? NULL : fdopendir(read_fd);
+    if (d == NULL) {
+        if (read_fd != -1)
+            close(read_fd);
+        return false;
+    }
+
+    bool rv = true;
+
+    struct dirent* entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        if (entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN) {
+            if (unlinkat(dir->fd, entry->d_name, 0) != 0)
+                rv = false;
+            continue;
+        }
+
+        struct stat st;
+        if (fstatat(dir->fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            rv = false;
+            continue;
+        }
+
+        if (!S_ISDIR(st.st_mode)) {
+            if (unlinkat(dir->fd, entry->d_name, 0) != 0)
+                rv = false;
+            continue;
+        }
+
+        // do not descend into other mounted filesystems
+        if (st.st_dev != rm->dev) {
+            rv = false;
+            continue;
+        }
+
+        pthread_mutex_lock(&rm->mutex);
+        if (!parallel_rm_push(rm, dir, entry->d_name))
+            rv = false;
+        pthread_mutex_unlock(&rm->mutex);
+    }
+
+    closedir(d);
+    return rv;
+}
+
+void* parallel_rm_worker(void* arg) {
+    struct parallel_rm* rm = arg;
+
+    pthread_mutex_lock(&rm->mutex);
+
+    for (;;) {
+        // while other workers are still reading directories, more work might show up
+        while (rm->count == 0 && rm->busy > 0)
+            pthread_cond_wait(&rm->cond, &rm->mutex);
+
+        if (rm->count == 0)
+            break;
+
+        struct parallel_rm_dir* dir = rm->queue[--rm->count];
+        rm->busy++;
+        pthread_mutex_unlock(&rm->mutex);
+
+        if (!parallel_rm_directory(rm, dir)) {
+            pthread_mutex_lock(&rm->mutex);
+            rm->failed = true;
+            pthread_mutex_unlock(&rm->mutex);
+        }
+
+        parallel_rm_complete(rm, dir);
+
+        pthread_mutex_lock(&rm->mutex);
+        rm->busy--;
+        if (rm->busy == 0 && rm->count == 0)
+            pthread_cond_broadcast(&rm->cond);
+    }
+
+    pthread_mutex_unlock(&rm->mutex);
+
+    return NULL;
+}
+
+/* Delete the directory tree at path in parallel, using the open directory fd to refer to it
+ * The workers share a queue of directories: each one unlinks the files in a directory, and queues its subdirectories.
+ * Directories are removed as soon as they're empty. Everything is done relative to directory fds, only path itself is
+ * removed by path, and only if it still refers to fd's directory.
+ * Returns false if anything is left, which is then deleted on a later attempt. */
+bool rm_recursive_parallel(const char* const path, const int fd, int threads) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISDIR(st.st_mode))
+        return false;
+
+    if (threads < 1)
+        threads = 1;
+
+    struct parallel_rm rm;
+    memset(&rm, 0, sizeof(rm));
+    rm.dev = st.st_dev;
+    pthread_mutex_init(&rm.mutex, NULL);
+    pthread_cond_init(&rm.cond, NULL);
+
+    struct parallel_rm_dir top;
+    memset(&top, 0, sizeof(top));
+    top.fd = fd;
+    top.pending = 1;
+
+    rm.queue = malloc(sizeof(struct parallel_rm_dir*));
+    if (rm.queue == NULL) {
+        rm.failed = true;
+    } else {
+        rm.queue[rm.count++] = &top;
+        rm.capacity = 1;
+
+        pthread_t thread_ids[threads];
+        int started = 0;
+        for (; started < threads - 1; started++) {
+            if (pthread_create(&thread_ids[started], NULL, parallel_rm_worker, &rm) != 0)
+                break;
+        }
+
+        parallel_rm_worker(&rm);
+
+        for (int i = 0; i < started; i++)
+            pthread_join(thread_ids[i], NULL);
+    }
+
+    free(rm.queue);
+    pthread_cond_destroy(&rm.cond);
+    pthread_mutex_destroy(&rm.mutex);
+
+    if (rm.failed || top.pending != 0)
+        return false;
+
+    struct stat path_st;
+    if (lstat(path, &path_st) != 0 || path_st.st_dev != st.st_dev || path_st.st_ino != st.st_ino)
+        return false;
+
+    return rmdir(path) == 0;
+}
+
+/* Delete the given (locked) trash directories in a detached process running at the lowest CPU and I/O priority
+ * The locks are passed on to that process, fds are closed in the calling process. */
+void delete_in_background(char* const* const paths, const int* const fds, const size_t count) {
+    const int max_threads = 8;
+
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        // detach from the session, and fork again so that the cleanup process is reparented and never becomes a zombie
+        setsid();
+        if (fork() != 0)
+            _exit(0);
+
+        // must not keep the caller's stdout or stderr open, e.g., when the output of the application is captured
+        int null_fd = open("/dev/null", O_RDWR);
+        if (null_fd != -1) {
+            dup2(null_fd, STDIN_FILENO);
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+            if (null_fd > STDERR_FILENO)
+                close(null_fd);
+        }
+
+        signal(SIGHUP, SIG_IGN);
+        signal(SIGINT, SIG_IGN);
+
+        if (nice(19) == -1) {
+            // not fatal, deletion just competes with other processes
+        }
+#ifdef __NR_ioprio_set
+        // IOPRIO_WHO_PROCESS, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT; the C library has neither constants nor wrapper
+        syscall(__NR_ioprio_set, 1, 0, 3 << 13);
+#endif
+
+        long threads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (threads < 1)
+            threads = 1;
+        if (threads > max_threads)
+            threads = max_threads;
+
+        for (size_t i = 0; i < count; i++)
+            rm_recursive_parallel(paths[i], fds[i], (int) threads);
+
+        _exit(0);
+    }
+
+    if (pid > 0)
+        waitpid(pid, NULL, 0);
+
+    for (size_t i = 0; i < count; i++)
+        close(fds[i]);
+}
+
+/* Delete trash directories left behind by extract-and-run processes which didn't finish cleaning up, in the background */
+void reap_stale_trash(const char* const temp_base) {
+    const char* const name_prefix = "appimage_extracted_";
+
+    DIR* dir = opendir(temp_base);
+    if (dir == NULL)
+        return;
+
+    char** paths = NULL;
+    int* fds = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, name_prefix, strlen(name_prefix)) != 0 || strstr(entry->d_name, TRASH_INFIX) == NULL)
+            continue;
+
+        char* path = malloc(strlen(temp_base) + strlen(entry->d_name) + 2);
+        sprintf(path, "%s/%s", temp_base, entry->d_name);
+
+        // trash which is locked is being deleted right now
+        // the temporary directory is shared with other users, who must not get this process to delete anything
+        struct stat st;
+        int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+        if (fd == -1 || flock(fd, LOCK_EX | LOCK_NB) != 0 || fstat(fd, &st) != 0 || st.st_uid != getuid()) {
+            if (fd != -1)
+                close(fd);
+            free(path);
+            continue;
+        }
+
+        if (count == capacity) {
+            capacity = capacity == 0 ? 4 : capacity * 2;
+            char** resized_paths = realloc(paths, capacity * sizeof(char*));
+            if (resized_paths != NULL)
+                paths = resized_paths;
+            int* resized_fds = realloc(fds, capacity * sizeof(int));
+            if (resized_fds != NULL)
+                fds = resized_fds;
+
+            if (resized_paths == NULL || resized_fds == NULL) {
+                // the trash is left for the next launch
+                close(fd);
+                free(path);
+                break;
+            }
+        }
+        paths[count] = path;
+        fds[count] = fd;
+        count++;
+    }
+    closedir(dir);
+
+    if (count > 0)
+        delete_in_background(paths, fds, count);
+
+    for (size_t i = 0; i < count; i++)
+        free(paths[i]);
+    free(paths);
+    free(fds);
+}
+
+/* Check whether an existing extraction can be used: a real directory owned by the user, which no one else can modify */
+bool is_trusted_extraction(const struct stat* const st) {
+    return S_ISDIR(st->st_mode) && st->st_uid == getuid() && (st->st_mode & (S_IWGRP | S_IWOTH)) == 0;
+}
+
+/* Extract the AppImage to prefix, unless it has been extracted there already
+ * When the same AppImage is launched many times at once, only one process extracts it: the contents are extracted
+ * into a staging directory while holding an exclusive lock on <prefix>.extract.lock, then the staging directory is
+ * renamed to prefix atomically. Other processes wait for the lock, then find prefix and reuse it.
+ * Therefore, prefix either does not exist or contains a complete extraction. Callers must make sure it is not removed
+ * while they are using it, e.g., by holding a shared lock on <prefix>.lock.
+ * prefix has a predictable name, and might be in a temporary directory shared with other users, who could create it
+ * before us. An existing prefix is only reused if it's a directory owned by the user which no one else can write to.
+ * Otherwise, it is replaced if it belongs to the user, or the extraction fails. */
+bool extract_appimage_shared(const char* const appimage_path, const char* const prefix, const bool verbose) {
+    struct stat st;
+    if (lstat(prefix, &st) == 0 && is_trusted_extraction(&st))
+        return true;
+
+    char extract_lock_path[strlen(prefix) + 14];
+    sprintf(extract_lock_path, "%s.extract.lock", prefix);
+
+    int lock_fd = lock_file(extract_lock_path, LOCK_EX);
+    if (lock_fd == -1) {
+        fprintf(stderr, "Failed to lock %s: %s\n", extract_lock_path, strerror(errno));
+        return false;
+    }
+
+    bool rv = true;
+
+    // another process might have published the extracted files while we were waiting for the lock
+    bool extracted = false;
+    if (lstat(prefix, &st) == 0) {
+        if (is_trusted_extraction(&st)) {
+            extracted = true;
+        } else if (st.st_uid != getuid()) {
+            fprintf(stderr, "%s is owned by another user, refusing to use it\n", prefix);
+            rv = false;
+        } else if (!(S_ISDIR(st.st_mode) ? rm_recursive(prefix) : unlink(prefix) == 0)) {
+            fprintf(stderr, "Failed to remove untrusted %s\n", prefix);
+            rv = false;
+        }
+    }
+
+    if (rv && !extracted) {
+        char staging_path[strlen(prefix) + 16];
+        sprintf(staging_path, "%s.staging-XXXXXX", prefix);
+
+        if (mkdtemp(staging_path) == NULL) {
+            fprintf(stderr, "Failed to create staging directory: %s\n", strerror(errno));
+            rv = false;
+        } else {
+            // mkdtemp creates the directory with mode 0700, use the same permissions as mkdir_p would
+            chmod(staging_path, 0755);
+
+            rv = extract_appimage(appimage_path, staging_path, NULL, true, verbose, NULL);
+
+            if (rv && rename(staging_path, prefix) != 0) {
+                fprintf(stderr, "Failed to move extracted files to %s: %s\n", prefix, strerror(errno));
+                rv = false;
+            }
+
+            if (!rv)
+                rm_recursive(staging_path);
+        }
+    }
+
+    // waiting processes will retry on a new lock file, see lock_file
+    unlink(extract_lock_path);
+    close(lock_fd);
+
+    return rv;
+}
+
+bool build_mount_point(char* mount_dir, const char* const argv0, char const* const temp_base, const size_t templen) {
+    const size_t maxnamelen = 6;
+
+    // when running for another AppImage, we should use that for building the mountpoint name instead
+    char* target_appimage = getenv("TARGET_APPIMAGE");
+
+    char* path_basename;
+    if (target_appimage != NULL) {
+        path_basename = basename(target_appimage);
+    } else {
+        path_basename = basename(argv0);
+    }
+
+    size_t namelen = strlen(path_basename);
+    // limit length of tempdir name
+    if (namelen > maxnamelen) {
+        namelen = maxnamelen;
+    }
+
+    strcpy(mount_dir, temp_base);
+    strncpy(mount_dir + templen, "/.mount_", 8);
+    strncpy(mount_dir + templen + 8, path_basename, namelen);
+    strncpy(mount_dir+templen+8+namelen, "XXXXXX", 6);
+    mount_dir[templen+8+namelen+6] = 0; // null terminate destination
+}
+
+/* Read the MD5 digest appimagetool embeds in the .digest_md5 section
+ * Returns false if the section is missing or has not been filled in (i.e., contains only zeroes) */
+bool read_embedded_digest_md5(const char* const appimage_path, MD5_HASH* digest) {
+    unsigned long offset = 0;
+    unsigned long length = 0;
+
+    if (!appimage_get_elf_section_offset_and_length(appimage_path, ".digest_md5", &offset, &length) || offset == 0 || length < sizeof(digest->bytes))
+        return false;
+
+    int fd = open(appimage_path, O_RDONLY);
+    if (fd == -1)
+        return false;
+
+    ssize_t bytes_read = pread(fd, digest->bytes, sizeof(digest->bytes), (off_t) offset);
+    close(fd);
+
+    if (bytes_read != (ssize_t) sizeof(digest->bytes))
+        return false;
+
+    for (size_t i = 0; i < sizeof(digest->bytes); i++) {
+        if (digest->bytes[i] != 0)
+            return true;
+    }
+
+    return false;
+}
+
+/* Calculate a digest of the file's identity and the squashfs superblock
+ * This is no content hash, but it changes whenever the file is replaced or modified, at the cost of a single stat and
+ * a tiny read, which is good enough to identify AppImages which lack an embedded digest */
+bool calculate_fingerprint_md5(const char* const appimage_path, MD5_HASH* digest) {
+    int fd = open(appimage_path, O_RDONLY);
+    if (fd == -1)
+        return false;
+
+    struct stat st;
+    struct squashfs_super_block sb;
+    bool rv = fstat(fd, &st) == 0 && pread(fd, &sb, sizeof(sb), (off_t) fs_offset) == (ssize_t) sizeof(sb);
+    close(fd);
+
+    if (!rv)
+        return false;
+
+    Md5Context ctx;
+    Md5Initialise(&ctx);
+
+    Md5Update(&ctx, &st.st_dev, sizeof(st.st_dev));
+    Md5Update(&ctx, &st.st_ino, sizeof(st.st_ino));
+    Md5Update(&ctx, &st.st_size, sizeof(st.st_size));
+    Md5Update(&ctx, &st.st_mtim.tv_sec, sizeof(st.st_mtim.tv_sec));
+    Md5Update(&ctx, &st.st_mtim.tv_nsec, sizeof(st.st_mtim.tv_nsec));
+    Md5Update(&ctx, &sb, sizeof(sb));
+
+    Md5Finalise(&ctx, digest);
+    return true;
+}
+
+/* Calculate the MD5 digest of the entire file */
+bool calculate_file_md5(const char* const appimage_path, MD5_HASH* digest) {
+    FILE* f = fopen(appimage_path, "rb");
+    if (f == NULL) {
+        perror("Failed to open AppImage file");
+        return false;
+    }
+
+    Md5Context ctx;
+    Md5Initialise(&ctx);
+
+    char buf[64 * 1024];
+    for (size_t bytes_read; (bytes_read = fread(buf, sizeof(char), sizeof(buf), f)) > 0;) {
+        Md5Update(&ctx, buf, (uint32_t) bytes_read);
+    }
+
+    fclose(f);
+
+    Md5Finalise(&ctx, digest);
+    return true;
+}
+
+/* Calculate the key used to make the extracted directory name "content-aware"
+ * see https://github.com/AppImage/AppImageKit/issues/841 for more information
+ * Hashing the entire file takes seconds for large AppImages, therefore the digest embedded by appimagetool is preferred,
+ * followed by a fingerprint of the file; the entire file is hashed only if neither is available
+ * Returns a hex string which must be freed by the caller, or NULL on errors */
+char* extract_and_run_cache_key(const char* const appimage_path) {
+    MD5_HASH digest;
+
+    if (!read_embedded_digest_md5(appimage_path, &digest) &&
+        !calculate_fingerprint_md5(appimage_path, &digest) &&
+        !calculate_file_md5(appimage_path, &digest)) {
+        return NULL;
+    }
+
+    return appimage_hexlify((const char*) digest.bytes, sizeof(digest.bytes));
+}
+
+/* Persistent extract-and-run cache
+ * Extracted trees are kept in $XDG_CACHE_HOME/appimage/extracted/<key>, and reused by later launches of the same
+ * AppImage. An index file records when each entry has last been used and how much disk space it occupies, so that the
+ * least recently used entries can be evicted once the cache exceeds its budget without walking the trees.
+ * The index is protected by an exclusive lock on index.lock. Every process using an entry holds a shared lock on
+ * <key>.lock, entries are only evicted if an exclusive lock can be obtained on them. */
+#define CACHE_INDEX_FILENAME "index"
+#define CACHE_INDEX_LOCK_FILENAME "index.lock"
+#define CACHE_DEFAULT_MAX_MB 4096
+
+struct cache_entry {
+    char key[64];
+    time_t last_used;
+    unsigned long long size;
+};
+
+/* Persistent caching is opt-in, as it trades disk space for startup time */
+bool persistent_cache_enabled(void) {
+    return getenv("APPIMAGE_EXTRACT_AND_RUN_CACHE") != NULL;
+}
+
+/* Disk budget of the persistent cache in bytes, taken from $APPIMAGE_EXTRACT_AND_RUN_CACHE_MAX_MB */
+unsigned long long persistent_cache_budget(void) {
+    unsigned long long max_mb = CACHE_DEFAULT_MAX_MB;
+
+    const char* const value = getenv("APPIMAGE_EXTRACT_AND_RUN_CACHE_MAX_MB");
+    if (value != NULL && *value != '\0') {
+        char* end;
+        unsigned long long parsed = strtoull(value, &end, 10);
+        if (*end != '\0') {
+            fprintf(stderr, "Invalid value for $APPIMAGE_EXTRACT_AND_RUN_CACHE_MAX_MB: %s, using default\n", value);
+        } else {
+            max_mb = parsed;
+        }
+    }
+
+    return max_mb * 1024 * 1024;
+}
+
+/* Build path to the directory name in the user's cache directory, following the XDG base directory specification */
+bool appimage_cache_dir(char* path, size_t path_size, const char* const name) {
+    const char* const xdg_cache_home = getenv("XDG_CACHE_HOME");
+    const char* const home = getenv("HOME");
+
+    int length;
+    if (xdg_cache_home != NULL && *xdg_cache_home == '/') {
+        length = snprintf(path, path_size, "%s/appimage/%s", xdg_cache_home, name);
+    } else if (home != NULL && *home != '\0') {
+        length = snprintf(path, path_size, "%s/.cache/appimage/%s", home, name);
+    } else {
+        return false;
+    }
+
+    return length > 0 && (size_t) length < path_size;
+}
+
+/* Build path to the persistent cache directory */
+bool persistent_cache_dir(char* path, size_t path_size) {
+    return appimage_cache_dir(path, path_size, "extracted");
+}
+
+/* Open and lock a lock file in the cache directory
+ * operation is passed to flock(2), returns the fd holding the lock or -1 */
+int persistent_cache_lock(const char* const cache_dir, const char* const name, const int operation) {
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/%s", cache_dir, name) >= (int) sizeof(path))
+        return -1;
+
+    return lock_file(path, operation);
+}
+
+/* Read the cache index, which must be locked by the caller
+ * A missing index results in an empty list, malformed lines are skipped */
+bool read_cache_index(const char* const cache_dir, struct cache_entry** entries, size_t* count) {
+    *entries = NULL;
+    *count = 0;
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/" CACHE_INDEX_FILENAME, cache_dir);
+
+    FILE* f = fopen(path, "r");
+    if (f == NULL)
+        return errno == ENOENT;
+
+    size_t capacity = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        struct cache_entry entry;
+        long long last_used;
+        if (sscanf(line, "%63s %lld %llu", entry.key, &last_used, &entry.size) != 3)
+            continue;
+        entry.last_used = (time_t) last_used;
+
+        if (*count == capacity) {
+            capacity = capacity == 0 ? 16 : capacity * 2;
+            struct cache_entry* resized = realloc(*entries, capacity * sizeof(struct cache_entry));
+            if (resized == NULL) {
+                fclose(f);
+                return false;
+            }
+            *entries = resized;
+        }
+        (*entries)[(*count)++] = entry;
+    }
+
+    fclose(f);
+    return true;
+}
+
+/* Replace the cache index atomically, the index must be locked by the caller */
+bool write_cache_index(const char* const cache_dir, const struct cache_entry* entries, const size_t count) {
+    char path[PATH_MAX];
+    char temp_path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/" CACHE_INDEX_FILENAME, cache_dir);
+    snprintf(temp_path, sizeof(temp_path), "%s/" CACHE_INDEX_FILENAME ".tmp", cache_dir);
+
+    FILE* f = fopen(temp_path, "w");
+    if (f == NULL)
+        return false;
+
+    for (size_t i = 0; i < count; i++) {
+        fprintf(f, "%s %lld %llu\n", entries[i].key, (long long) entries[i].last_used, entries[i].size);
+    }
+
+    if (fclose(f) != 0 || rename(temp_path, path) != 0) {
+        unlink(temp_path);
+        return false;
+    }
+
+    return true;
+}
+
+int compare_cache_entries_by_last_use(const void* a, const void* b) {
+    const struct cache_entry* entry_a = a;
+    const struct cache_entry* entry_b = b;
+
+    if (entry_a->last_used < entry_b->last_used)
+        return -1;
+    return entry_a->last_used > entry_b->last_used ? 1 : 0;
+}
+
+/* Remove directories in the cache which are not in the index, the index must be locked by the caller
+ * These are left behind by processes which crashed (or failed to write the index) after publishing an entry, or while
+ * extracting into a staging directory. Neither is accounted for in the index, and would never be evicted otherwise.
+ * Like indexed entries, they are only removed if they aren't in use, i.e., their lock can be obtained. */
+void remove_unindexed_cache_entries(const char* const cache_dir, const struct cache_entry* entries, const size_t count,
+                                    const char* const current_key) {
+    const char* const staging_infix = ".staging-";
+
+    DIR* dir = opendir(cache_dir);
+    if (dir == NULL)
+        return;
+
+    struct dirent* dirent;
+    while ((dirent = readdir(dir)) != NULL) {
+        if (dirent->d_name[0] == '.')
+            continue;
+
+        char path[PATH_MAX];
+        struct stat st;
+        if (snprintf(path, sizeof(path), "%s/%s", cache_dir, dirent->d_name) >= (int) sizeof(path) ||
+            lstat(path, &st) != 0 || !S_ISDIR(st.st_mode))
+            continue;
+
+        char key[sizeof(entries[0].key)];
+        const char* const staging = strstr(dirent->d_name, staging_infix);
+        const size_t key_length = staging != NULL ? (size_t) (staging - dirent->d_name) : strlen(dirent->d_name);
+        if (key_length >= sizeof(key))
+            continue;
+        memcpy(key, dirent->d_name, key_length);
+        key[key_length] = '\0';
+
+        // staging directories are in use while the extraction is running, published entries while they're used
+        char lock_name[sizeof(key) + 13];
+        if (staging != NULL) {
+            snprintf(lock_name, sizeof(lock_name), "%s.extract.lock", key);
+        } else {
+            bool indexed = strcmp(key, current_key) == 0;
+            for (size_t i = 0; !indexed && i < count; i++) {
+                if (strcmp(entries[i].key, key) == 0)
+                    indexed = true;
+            }
+            if (indexed)
+                continue;
+
+            snprintf(lock_name, sizeof(lock_name), "%s.lock", key);
+        }
+
+        int lock_fd = persistent_cache_lock(cache_dir, lock_name, LOCK_EX | LOCK_NB);
+        if (lock_fd == -1)
+            continue;
+
+        if (!rm_recursive(path)) {
+            fprintf(stderr, "Failed to remove %s from cache\n", dirent->d_name);
+        } else {
+            // processes waiting for the lock notice it's been unlinked, and lock a new file
+            snprintf(path, sizeof(path), "%s/%s", cache_dir, lock_name);
+            unlink(path);
+        }
+
+        close(lock_fd);
+    }
+
+    closedir(dir);
+}
+
+/* Evict least recently used entries until the cache fits into budget, the index must be locked by the caller
+ * Entries which are in use (including the one for current_key) are never evicted */
+void evict_cache_entries(const char* const cache_dir, struct cache_entry* entries, size_t* count,
+                         const unsigned long long budget, const char* const current_key) {
+    remove_unindexed_cache_entries(cache_dir, entries, *count, current_key);
+
+    unsigned long long total = 0;
+    for (size_t i = 0; i < *count; i++) {
+        total += entries[i].size;
+    }
+
+    qsort(entries, *count, sizeof(struct cache_entry), compare_cache_entries_by_last_use);
+
+    size_t kept = 0;
+    for (size_t i = 0; i < *count; i++) {
+        bool evicted = false;
+
+        if (total > budget && strcmp(entries[i].key, current_key) != 0) {
+            char lock_name[sizeof(entries[i].key) + 5];
+            snprintf(lock_name, sizeof(lock_name), "%s.lock", entries[i].key);
+
+            int lock_fd = persistent_cache_lock(cache_dir, lock_name, LOCK_EX | LOCK_NB);
+            if (lock_fd != -1) {
+                char path[PATH_MAX];
+                snprintf(path, sizeof(path), "%s/%s", cache_dir, entries[i].key);
+
+                if (access(path, F_OK) == -1 || rm_recursive(path)) {
+                    snprintf(path, sizeof(path), "%s/%s", cache_dir, lock_name);
+                    unlink(path);
+                    total -= entries[i].size;
+                    evicted = true;
+                } else {
+                    fprintf(stderr, "Failed to evict %s from cache\n", entries[i].key);
+                }
+
+                close(lock_fd);
+            }
+        }
+
+        if (!evicted)
+            entries[kept++] = entries[i];
+    }
+
+    *count = kept;
+}
+
+static unsigned long long disk_usage_total;
+
+int disk_usage_callback(const char* path, const struct stat* stat, const int type, struct FTW* ftw) {
+    (void) path;
+    (void) type;
+    (void) ftw;
+
+    disk_usage_total += (unsigned long long) stat->st_blocks * 512;
+    return 0;
+}
+
+/* Disk space occupied by a directory tree */
+unsigned long long disk_usage(const char* const path) {
+    disk_usage_total = 0;
+    nftw(path, &disk_usage_callback, 16, FTW_MOUNT | FTW_PHYS);
+    return disk_usage_total;
+}
+
+/* Record the use of the entry for key in the index, then enforce the cache's budget */
+void update_cache_index(const char* const cache_dir, const char* const key, const bool update_size) {
+    int index_lock_fd = persistent_cache_lock(cache_dir, CACHE_INDEX_LOCK_FILENAME, LOCK_EX);
+    if (index_lock_fd == -1) {
+        fprintf(stderr, "Failed to lock cache index: %s\n", strerror(errno));
+        return;
+    }
+
+    struct cache_entry* entries;
+    size_t count;
+    if (!read_cache_index(cache_dir, &entries, &count)) {
+        fprintf(stderr, "Failed to read cache index\n");
+        close(index_lock_fd);
+        return;
+    }
+
+    struct cache_entry* entry = NULL;
+    for (size_t i = 0; i < count; i++) {
+        if (strcmp(entries[i].key, key) == 0)
+            entry = &entries[i];
+    }
+
+    if (entry == NULL) {
+        struct cache_entry* resized = realloc(entries, (count + 1) * sizeof(struct cache_entry));
+        if (resized == NULL) {
+            free(entries);
+            close(index_lock_fd);
+            return;
+        }
+        entries = resized;
+        entry = &entries[count++];
+        memset(entry, 0, sizeof(*entry));
+        strncpy(entry->key, key, sizeof(entry->key) - 1);
+    }
+
+    entry->last_used = time(NULL);
+
+    if (update_size) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", cache_dir, key);
+        entry->size = disk_usage(path);
+    }
+
+    evict_cache_entries(cache_dir, entries, &count, persistent_cache_budget(), key);
+
+    if (!write_cache_index(cache_dir, entries, count))
+        fprintf(stderr, "Failed to write cache index\n");
+
+    free(entries);
+    close(index_lock_fd);
+}
+
+/* Extract the AppImage into the persistent cache, or reuse a previous extraction
+ * On success, the path to the extracted tree is returned, and *entry_lock_fd holds a shared lock which prevents other
+ * processes from evicting the entry until it is closed */
+char* extract_to_persistent_cache(const char* const appimage_path, const char* const key, const bool verbose, int* entry_lock_fd) {
+    char cache_dir[PATH_MAX];
+    if (!persistent_cache_dir(cache_dir, sizeof(cache_dir))) {
+        fprintf(stderr, "Could not determine cache directory\n");
+        return NULL;
+    }
+
+    if (mkdir_p(cache_dir) == -1) {
+        fprintf(stderr, "Failed to create cache directory %s: %s\n", cache_dir, strerror(errno));
+        return NULL;
+    }
+
+    char* prefix = malloc(strlen(cache_dir) + 1 + strlen(key) + 1);
+    sprintf(prefix, "%s/%s", cache_dir, key);
+
+    char lock_name[strlen(key) + 6];
+    sprintf(lock_name, "%s.lock", key);
+
+    // the entry must be locked while holding the index lock, otherwise it might be evicted in between
+    int index_lock_fd = persistent_cache_lock(cache_dir, CACHE_INDEX_LOCK_FILENAME, LOCK_EX);
+    if (index_lock_fd == -1) {
+        fprintf(stderr, "Failed to lock cache index: %s\n", strerror(errno));
+        free(prefix);
+        return NULL;
+    }
+
+    *entry_lock_fd = persistent_cache_lock(cache_dir, lock_name, LOCK_SH);
+    close(index_lock_fd);
+
+    if (*entry_lock_fd == -1) {
+        fprintf(stderr, "Failed to lock cache entry: %s\n", strerror(errno));
+        free(prefix);
+        return NULL;
+    }
+
+    // entries are published only once they have been extracted completely
+    const bool hit = access(prefix, F_OK) == 0;
+
+    if (!hit) {
+        if (!extract_appimage_shared(appimage_path, prefix, verbose)) {
+            close(*entry_lock_fd);
+            *entry_lock_fd = -1;
+            free(prefix);
+            return NULL;
+        }
+    }
+
+    update_cache_index(cache_dir, key, !hit);
+
+    return prefix;
+}
+
+void set_portable_home_and_config(char *basepath) {
+    char portable_home_dir[PATH_MAX];
+    char portable_config_dir[PATH_MAX];
+
+    /* If there is a directory with the same name as the AppImage plus ".home", then export $HOME */
+    strcpy (portable_home_dir, basepath);
+    strcat (portable_home_dir, ".home");
+    if(is_writable_directory(portable_home_dir)){
+        fprintf(stderr, "Setting $HOME to %s\n", portable_home_dir);
+        setenv("HOME",portable_home_dir,1);
+    }
+
+    /* If there is a directory with the same name as the AppImage plus ".config", then export $XDG_CONFIG_HOME */
+    strcpy (portable_config_dir, basepath);
+    strcat (portable_config_dir, ".config");
+    if(is_writable_directory(portable_config_dir)){
+        fprintf(stderr, "Setting $XDG_CONFIG_HOME to %s\n", portable_config_dir);
+        setenv("XDG_CONFIG_HOME",portable_config_dir,1);
+    }
+}
+
+/* Shared mounts
+ * If $APPIMAGE_SHARED_MOUNT is set, all instances of an AppImage run by the same user use a single FUSE mount at
+ * <temp_base>/appimage-mounts-<uid>/<key>, where the key is derived from the AppImage's contents and inode. The first
+ * instance mounts it, later ones find it mounted and run from it right away. The mount is removed by the FUSE process
+ * once no instance has been running for $APPIMAGE_SHARED_MOUNT_IDLE_TIMEOUT seconds, so that relaunches in quick
+ * succession don't have to mount again. */
+#define SHARED_MOUNT_DEFAULT_IDLE_TIMEOUT 30
+
+bool shared_mount_enabled(void) {
+    return getenv("APPIMAGE_SHARED_MOUNT") != NULL;
+}
+
+/* Seconds a shared mount is kept after the last instance has exited, taken from $APPIMAGE_SHARED_MOUNT_IDLE_TIMEOUT */
+unsigned int shared_mount_idle_timeout(void) {
+    const char* const value = getenv("APPIMAGE_SHARED_MOUNT_IDLE_TIMEOUT");
+    if (value == NULL || *value == '\0')
+        return SHARED_MOUNT_DEFAULT_IDLE_TIMEOUT;
+
+    char* end;
+    unsigned long parsed = strtoul(value, &end, 10);
+    if (*end != '\0' || parsed > UINT_MAX) {
+        fprintf(stderr, "Invalid value for $APPIMAGE_SHARED_MOUNT_IDLE_TIMEOUT: %s, using default\n", value);
+        return SHARED_MOUNT_DEFAULT_IDLE_TIMEOUT;
+    }
+
+    return (unsigned int) parsed;
+}
+
+/* Set up the paths of the shared mount for an AppImage, and lock its mount lock exclusively
+ * The directory holding the shared mounts is private to the user, as anybody could otherwise plant a "mount" in it
+ * Returns false if shared mounts cannot be used, in which case a private mount should be used instead */
+bool shared_mount_open(struct shared_mount* shared, const char* const appimage_path, const char* const temp_base) {
+    shared->lock_fd = -1;
+    shared->users_fd = -1;
+    shared->idle_timeout = shared_mount_idle_timeout();
+
+    struct stat appimage_stat;
+    if (stat(appimage_path, &appimage_stat) == -1) {
+        fprintf(stderr, "Failed to stat %s: %s\n", appimage_path, strerror(errno));
+        return false;
+    }
+
+    char base_dir[PATH_MAX];
+    if (snprintf(base_dir, sizeof(base_dir), "%s/appimage-mounts-%u", temp_base, (unsigned int) getuid()) >= (int) sizeof(base_dir))
+        return false;
+
+    struct stat base_stat;
+    if ((mkdir(base_dir, 0700) == -1 && errno != EEXIST) || lstat(base_dir, &base_stat) == -1) {
+        fprintf(stderr, "Failed to create %s: %s\n", base_dir, strerror(errno));
         return false;
-    };
+    }
 
-    // track duplicate inodes for hardlinks
-    char** created_inode = calloc(fs.sb.inodes, sizeof(char*));
-    if (created_inode == NULL) {
-        fprintf(stderr, "Failed allocating memory to track hardlinks\n");
+    if (!S_ISDIR(base_stat.st_mode) || base_stat.st_uid != getuid() || (base_stat.st_mode & 077) != 0) {
+        fprintf(stderr, "Not using shared mounts, %s is not a private directory\n", base_dir);
         return false;
     }
 
-    if ((err = sqfs_traverse_open(&trv, &fs, sqfs_inode_root(&fs)))) {
-        fprintf(stderr, "sqfs_traverse_open error\n");
-        free(created_inode);
+    char* digest = extract_and_run_cache_key(appimage_path);
+    if (digest == NULL) {
+        fprintf(stderr, "Failed to calculate cache key for AppImage\n");
         return false;
     }
 
-    bool rv = true;
+    int length = snprintf(shared->mount_dir, sizeof(shared->mount_dir), "%s/%s-%llx-%llx", base_dir, digest,
+                          (unsigned long long) appimage_stat.st_dev, (unsigned long long) appimage_stat.st_ino);
+    free(digest);
 
-    while (sqfs_traverse_next(&trv, &err)) {
-        if (!trv.dir_end) {
-            if (_pattern == NULL || fnmatch(_pattern, trv.path, FNM_FILE_NAME | FNM_LEADING_DIR) == 0) {
-                // fprintf(stderr, "trv.path: %s\n", trv.path);
-                // fprintf(stderr, "sqfs_inode_id: %lu\n", trv.entry.inode);
-                sqfs_inode inode;
-                if (sqfs_inode_get(&fs, &inode, trv.entry.inode)) {
-                    fprintf(stderr, "sqfs_inode_get error\n");
-                    rv = false;
-                    break;
-                }
-                // fprintf(stderr, "inode.base.inode_type: %i\n", inode.base.inode_type);
-                // fprintf(stderr, "inode.xtra.reg.file_size: %lu\n", inode.xtra.reg.file_size);
-                strcpy(prefixed_path_to_extract, "");
-                strcat(strcat(prefixed_path_to_extract, prefix), trv.path);
-
-                if (verbose)
-                    fprintf(stdout, "%s\n", prefixed_path_to_extract);
-
-                if (inode.base.inode_type == SQUASHFS_DIR_TYPE || inode.base.inode_type == SQUASHFS_LDIR_TYPE) {
-                    // fprintf(stderr, "inode.xtra.dir.parent_inode: %ui\n", inode.xtra.dir.parent_inode);
-                    // fprintf(stderr, "mkdir_p: %s/\n", prefixed_path_to_extract);
-                    if (access(prefixed_path_to_extract, F_OK) == -1) {
-                        if (mkdir_p(prefixed_path_to_extract) == -1) {
-                            perror("mkdir_p error");
-                            rv = false;
-                            break;
-                        }
-                    }
-                } else if (inode.base.inode_type == SQUASHFS_REG_TYPE || inode.base.inode_type == SQUASHFS_LREG_TYPE) {
-                    // if we've already created this inode, then this is a hardlink
-                    char* existing_path_for_inode = created_inode[inode.base.inode_number - 1];
-                    if (existing_path_for_inode != NULL) {
-                        unlink(prefixed_path_to_extract);
-                        if (link(existing_path_for_inode, prefixed_path_to_extract) == -1) {
-                            fprintf(stderr, "Couldn't create hardlink from \"%s\" to \"%s\": %s\n",
-                                prefixed_path_to_extract, existing_path_for_inode, strerror(errno));
-                            rv = false;
-                            break;
-                        } else {
-                            continue;
-                        }
-                    } else {
-                        struct stat st;
-                        if (!overwrite && stat(prefixed_path_to_extract, &st) == 0 && st.st_size == inode.xtra.reg.file_size) {
-                            fprintf(stderr, "File exists and file size matches, skipping\n");
-                            continue;
-                        }
-
-                        // track the path we extract to for this inode, so that we can `link` if this inode is found again
-                        created_inode[inode.base.inode_number - 1] = strdup(prefixed_path_to_extract);
-                        // fprintf(stderr, "Extract to: %s\n", prefixed_path_to_extract);
-                        if (private_sqfs_stat(&fs, &inode, &st) != 0)
-                            die("private_sqfs_stat error");
-
-                        // create parent dir
-                        char* p = strrchr(prefixed_path_to_extract, '/');
-                        if (p) {
-                            // set an \0 to end the split the string
-                            *p = '\0';
-                            mkdir_p(prefixed_path_to_extract);
-
-                            // restore dir seprator
-                            *p = '/';
-                        }
-
-                        // Read the file in chunks
-                        off_t bytes_already_read = 0;
-                        sqfs_off_t bytes_at_a_time = 64 * 1024;
-                        FILE* f;
-                        f = fopen(prefixed_path_to_extract, "w+");
-                        if (f == NULL) {
-                            perror("fopen error");
-                            rv = false;
-                            break;
-                        }
-                        while (bytes_already_read < inode.xtra.reg.file_size) {
-                            char buf[bytes_at_a_time];
-                            if (sqfs_read_range(&fs, &inode, (sqfs_off_t) bytes_already_read, &bytes_at_a_time, buf)) {
-                                perror("sqfs_read_range error");
-                                rv = false;
-                                break;
-                            }
-                            // fwrite(buf, 1, bytes_at_a_time, stdout);
-                            fwrite(buf, 1, bytes_at_a_time, f);
-                            bytes_already_read = bytes_already_read + bytes_at_a_time;
-                        }
-                        fclose(f);
-                        chmod(prefixed_path_to_extract, st.st_mode);
-                        if (!rv)
-                            break;
-                    }
-                } else if (inode.base.inode_type == SQUASHFS_SYMLINK_TYPE || inode.base.inode_type == SQUASHFS_LSYMLINK_TYPE) {
-                    size_t size;
-                    sqfs_readlink(&fs, &inode, NULL, &size);
-                    char buf[size];
-                    int ret = sqfs_readlink(&fs, &inode, buf, &size);
-                    if (ret != 0) {
-                        perror("symlink error");
-                        rv = false;
-                        break;
-                    }
-                    // fprintf(stderr, "Symlink: %s to %s \n", prefixed_path_to_extract, buf);
-                    unlink(prefixed_path_to_extract);
-                    ret = symlink(buf, prefixed_path_to_extract);
-                    if (ret != 0)
-                        fprintf(stderr, "WARNING: could not create symlink\n");
-                } else {
-                    fprintf(stderr, "TODO: Implement inode.base.inode_type %i\n", inode.base.inode_type);
-                }
-                // fprintf(stderr, "\n");
+    if (length >= (int) sizeof(shared->mount_dir) ||
+        snprintf(shared->lock_path, sizeof(shared->lock_path), "%s.lock", shared->mount_dir) >= (int) sizeof(shared->lock_path) ||
+        snprintf(shared->users_path, sizeof(shared->users_path), "%s.users", shared->mount_dir) >= (int) sizeof(shared->users_path)) {
+        return false;
+    }
 
-                if (!rv)
-                    break;
-            }
-        }
+    // the FUSE process opens the users lock on its own, hence it must exist before forking
+    int users_fd = open(shared->users_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (users_fd == -1) {
+        fprintf(stderr, "Failed to create %s: %s\n", shared->users_path, strerror(errno));
+        return false;
     }
-    for (int i = 0; i < fs.sb.inodes; i++) {
-        free(created_inode[i]);
+    close(users_fd);
+
+    // not using lock_file, as the lock files are never unlinked and the FUSE process must be able to reopen them
+    shared->lock_fd = open(shared->lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (shared->lock_fd == -1 || flock(shared->lock_fd, LOCK_EX) == -1) {
+        fprintf(stderr, "Failed to lock %s: %s\n", shared->lock_path, strerror(errno));
+        if (shared->lock_fd != -1)
+            close(shared->lock_fd);
+        shared->lock_fd = -1;
+        return false;
     }
-    free(created_inode);
 
-    if (err != SQFS_OK) {
-        fprintf(stderr, "sqfs_traverse_next error\n");
-        rv = false;
+    return true;
+}
+
+/* Check whether the shared mount is currently mounted, i.e., is on a different device than its parent directory
+ * A FUSE process which died without unmounting leaves a mount behind which fails with ENOTCONN, stale is set then */
+bool shared_mount_is_mounted(const struct shared_mount* const shared, bool* stale) {
+    *stale = false;
+
+    char base_dir[PATH_MAX];
+    strcpy(base_dir, shared->mount_dir);
+    *strrchr(base_dir, '/') = '\0';
+
+    struct stat mount_stat;
+    struct stat base_stat;
+    if (stat(shared->mount_dir, &mount_stat) == -1) {
+        *stale = (errno == ENOTCONN);
+        return false;
     }
-    sqfs_traverse_close(&trv);
-    sqfs_fd_close(fs.fd);
 
-    return rv;
+    return stat(base_dir, &base_stat) == 0 && mount_stat.st_dev != base_stat.st_dev;
 }
 
-int rm_recursive_callback(const char* path, const struct stat* stat, const int type, struct FTW* ftw) {
-    (void) stat;
-    (void) ftw;
+/* Detach a stale shared mount, so that the directory can be mounted again; must be called with the mount lock held
+ * The mount is detached lazily, as applications which used it might still hold open files on it */
+bool shared_mount_unmount_stale(const struct shared_mount* const shared) {
+    pid_t pid = fork();
+    if (pid == -1)
+        return false;
 
-    switch (type) {
-        case FTW_NS:
-        case FTW_DNR:
-            fprintf(stderr, "%s: ftw error: %s\n",
-                path, strerror(errno));
-            return 1;
+    if (pid == 0) {
+        execlp("fusermount", "fusermount", "-uz", shared->mount_dir, (char*) NULL);
+        execlp("fusermount3", "fusermount3", "-uz", shared->mount_dir, (char*) NULL);
+        _exit(EXIT_EXECERROR);
+    }
 
-        case FTW_D:
-            // ignore directories at first, will be handled by FTW_DP
-            break;
+    int status;
+    if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return false;
 
-        case FTW_F:
-        case FTW_SL:
-        case FTW_SLN:
-            if (remove(path) != 0) {
-                fprintf(stderr, "Failed to remove %s: %s\n", path, strerror(errno));
-                return false;
-            }
-            break;
+    struct stat st;
+    return stat(shared->mount_dir, &st) == 0;
+}
 
+/* Register this instance as a user of the shared mount, and let other instances proceed
+ * The lock on the users file is held by the application, as the fd is inherited through execv */
+bool shared_mount_join(struct shared_mount* shared) {
+    shared->users_fd = open(shared->users_path, O_RDWR);
+    if (shared->users_fd == -1 || flock(shared->users_fd, LOCK_SH) == -1) {
+        fprintf(stderr, "Failed to lock %s: %s\n", shared->users_path, strerror(errno));
+        return false;
+    }
 
-        case FTW_DP:
-            if (rmdir(path) != 0) {
-                fprintf(stderr, "Failed to remove directory %s: %s\n", path, strerror(errno));
-                return false;
-            }
-            break;
+    // the FUSE process shares the open file description of the mount lock, it must be unlocked explicitly
+    flock(shared->lock_fd, LOCK_UN);
+    close(shared->lock_fd);
+    shared->lock_fd = -1;
 
-        default:
-            fprintf(stderr, "Unexpected fts_info\n");
-            return 1;
+    return true;
+}
+
+/* Profile-guided prefetching, enabled by setting $APPIMAGE_PREFETCH
+ * The first launch records which parts of the image are read while the application starts up, see
+ * prefetch_record_profile. The profile is stored in $XDG_CACHE_HOME/appimage/prefetch/<key>, keyed like the
+ * extract-and-run cache. Subsequent launches have the FUSE process read these parts into the page cache right after
+ * mounting, while AppRun is being executed, rather than one request at a time as the application gets to them. This
+ * helps most with images on slow or high latency storage, e.g., network file systems. Delete the profile to record a
+ * new one, e.g., after the application's startup behavior changed. */
+bool prefetch_enabled(void) {
+    return getenv("APPIMAGE_PREFETCH") != NULL;
+}
+
+bool prefetch_init(struct prefetch* prefetch, const char* const appimage_path) {
+    if (realpath(appimage_path, prefetch->image_path) == NULL)
+        return false;
+
+    char profile_dir[PATH_MAX];
+    if (!appimage_cache_dir(profile_dir, sizeof(profile_dir), "prefetch"))
+        return false;
+
+    if (mkdir_p(profile_dir) == -1) {
+        fprintf(stderr, "Failed to create %s: %s\n", profile_dir, strerror(errno));
+        return false;
     }
 
-    return 0;
-};
+    char* key = extract_and_run_cache_key(appimage_path);
+    if (key == NULL)
+        return false;
 
-bool rm_recursive(const char* const path) {
-    // FTW_DEPTH: perform depth-first search to make sure files are deleted before the containing directories
-    // FTW_MOUNT: prevent deletion of files on other mounted filesystems
-    // FTW_PHYS: do not follow symlinks, but report symlinks as such; this way, the symlink targets, which might point
-    //           to locations outside path will not be deleted accidentally (attackers might abuse this)
-    int rv = nftw(path, &rm_recursive_callback, 0, FTW_DEPTH | FTW_MOUNT | FTW_PHYS);
+    int length = snprintf(prefetch->profile_path, sizeof(prefetch->profile_path), "%s/%s", profile_dir, key);
+    free(key);
 
-    return rv == 0;
+    return length < (int) sizeof(prefetch->profile_path);
 }
 
-bool build_mount_point(char* mount_dir, const char* const argv0, char const* const temp_base, const size_t templen) {
-    const size_t maxnamelen = 6;
+/* The image never changes while it is mounted, hence the kernel may cache everything for as long as it likes
+ * kernel_cache keeps file contents in the page cache when files are closed and opened again. The timeouts (in seconds)
+ * make the kernel remember directory entries, attributes and names which don't exist (e.g., the library paths ld.so
+ * probes) without asking the FUSE process again */
+#define FUSE_CACHE_OPTIONS "kernel_cache,entry_timeout=86400,attr_timeout=86400,negative_timeout=86400"
+
+/* The FUSE process serves requests with libfuse's default multi-threaded loop, as it always has
+ * Setting $APPIMAGE_FUSE_SINGLE_THREADED serves all requests on a single thread instead (libfuse's -s option). This is
+ * meant for debugging, e.g., to rule out concurrency issues; it is not a performance setting. libfuse 2 offers no way
+ * to size the worker pool. */
+bool fuse_single_threaded(void) {
+    return getenv("APPIMAGE_FUSE_SINGLE_THREADED") != NULL;
+}
 
-    // when running for another AppImage, we should use that for building the mountpoint name instead
-    char* target_appimage = getenv("TARGET_APPIMAGE");
+/* Run AppRun from a mounted AppImage, or print the mount point and wait if --appimage-mount was passed
+ * Does not return */
+void run_from_mount_dir(const char* const mount_dir, const char* const arg, int argc, char* argv[],
+                        char* fullpath, const char* const argv0_path, const uint64_t launch_start) {
+    int dir_fd, res;
+    char **real_argv;
+    int i;
 
-    char* path_basename;
-    if (target_appimage != NULL) {
-        path_basename = basename(target_appimage);
-    } else {
-        path_basename = basename(argv0);
+    dir_fd = open (mount_dir, O_RDONLY);
+    if (dir_fd == -1) {
+        perror ("open dir error");
+        exit (EXIT_EXECERROR);
     }
 
-    size_t namelen = strlen(path_basename);
-    // limit length of tempdir name
-    if (namelen > maxnamelen) {
-        namelen = maxnamelen;
+    res = dup2 (dir_fd, 1023);
+    if (res == -1) {
+        perror ("dup2 error");
+        exit (EXIT_EXECERROR);
     }
+    close (dir_fd);
 
-    strcpy(mount_dir, temp_base);
-    strncpy(mount_dir + templen, "/.mount_", 8);
-    strncpy(mount_dir + templen + 8, path_basename, namelen);
-    strncpy(mount_dir+templen+8+namelen, "XXXXXX", 6);
-    mount_dir[templen+8+namelen+6] = 0; // null terminate destination
-}
+    real_argv = malloc (sizeof (char *) * (argc + 1));
+    for (i = 0; i < argc; i++) {
+        real_argv[i] = argv[i];
+    }
+    real_argv[i] = NULL;
 
-void set_portable_home_and_config(char *basepath) {
-    char portable_home_dir[PATH_MAX];
-    char portable_config_dir[PATH_MAX];
+    if(arg && strcmp(arg, "appimage-mount") == 0) {
+        char real_mount_dir[PATH_MAX];
 
-    /* If there is a directory with the same name as the AppImage plus ".home", then export $HOME */
-    strcpy (portable_home_dir, basepath);
-    strcat (portable_home_dir, ".home");
-    if(is_writable_directory(portable_home_dir)){
-        fprintf(stderr, "Setting $HOME to %s\n", portable_home_dir);
-        setenv("HOME",portable_home_dir,1);
+        trace_phase("launch", launch_start, monotonic_time_ns());
+
+        if (realpath(mount_dir, real_mount_dir) == real_mount_dir) {
+            printf("%s\n", real_mount_dir);
+        } else {
+            printf("%s\n", mount_dir);
+        }
+
+        // stdout is, by default, buffered (unlike stderr), therefore in order to allow other processes to read
+        // the path from stdout, we need to flush the buffers now
+        // this is a less-invasive alternative to setbuf(stdout, NULL);
+        fflush(stdout);
+
+        for (;;) pause();
+
+        exit(0);
     }
 
-    /* If there is a directory with the same name as the AppImage plus ".config", then export $XDG_CONFIG_HOME */
-    strcpy (portable_config_dir, basepath);
-    strcat (portable_config_dir, ".config");
-    if(is_writable_directory(portable_config_dir)){
-        fprintf(stderr, "Setting $XDG_CONFIG_HOME to %s\n", portable_config_dir);
-        setenv("XDG_CONFIG_HOME",portable_config_dir,1);
+    /* Setting some environment variables that the app "inside" might use */
+    setenv( "APPIMAGE", fullpath, 1 );
+    setenv( "ARGV0", argv0_path, 1 );
+    setenv( "APPDIR", mount_dir, 1 );
+
+    set_portable_home_and_config(fullpath);
+
+    /* Original working directory */
+    char cwd[1024];
+    if (getcwd(cwd, sizeof(cwd)) != NULL) {
+        setenv( "OWD", cwd, 1 );
     }
+
+    char filename[strlen(mount_dir) + 8]; /* enough for mount_dir + "/AppRun" */
+    strcpy (filename, mount_dir);
+    strcat (filename, "/AppRun");
+
+    trace_phase("launch", launch_start, monotonic_time_ns());
+
+    /* TODO: Find a way to get the exit status and/or output of this */
+    execv (filename, real_argv);
+    /* Error if we continue here */
+    perror("execv error");
+    exit(EXIT_EXECERROR);
 }
 
 int main(int argc, char *argv[]) {
@@ -550,6 +4938,11 @@ int main(int argc, char *argv[]) {
     char argv0_path[PATH_MAX];
     char * arg;
 
+    const uint64_t launch_start = monotonic_time_ns();
+    uint64_t phase_start;
+
+    trace_init();
+
     /* We might want to operate on a target appimage rather than this file itself,
      * e.g., for appimaged which must not run untrusted code from random AppImages.
      * This variable is intended for use by e.g., appimaged and is subject to
@@ -608,7 +5001,9 @@ int main(int argc, char *argv[]) {
             strcpy(temp_base, getenv("TMPDIR"));
     }
 
+    phase_start = monotonic_time_ns();
     fs_offset = appimage_get_elf_size(appimage_path);
+    trace_phase("elf_size", phase_start, monotonic_time_ns());
 
     // error check
     if (fs_offset < 0) {
@@ -641,25 +5036,110 @@ int main(int argc, char *argv[]) {
 
     arg=getArg(argc,argv,'-');
 
+    /* write a single file from the AppImage to stdout */
+    if(arg && strcmp(arg,"appimage-cat")==0) {
+        if (argc != 3) {
+            fprintf(stderr, "Usage: %s --appimage-cat <path>\n", argv[0]);
+            exit(1);
+        }
+
+        if (!cat_appimage_file(appimage_path, argv[2], STDOUT_FILENO))
+            exit(1);
+
+        exit(0);
+    }
+
+    /* list the contents of the AppImage */
+    if(arg && strcmp(arg,"appimage-list")==0) {
+        bool json = false;
+        bool compressed_size = false;
+
+        // options come first, all remaining arguments are patterns
+        int first_pattern = 2;
+        for (; first_pattern < argc; first_pattern++) {
+            if (strcmp(argv[first_pattern], "--json") == 0)
+                json = true;
+            else if (strcmp(argv[first_pattern], "--compressed-size") == 0)
+                compressed_size = true;
+            else
+                break;
+        }
+
+        char** patterns = NULL;
+        char** pattern_file_patterns = NULL;
+
+        if (!patterns_from_args(argc, argv, first_pattern, &patterns, &pattern_file_patterns))
+            exit(1);
+
+        if (!list_appimage(appimage_path, patterns, json, compressed_size))
+            exit(1);
+
+        if (pattern_file_patterns != NULL)
+            free_patterns(pattern_file_patterns);
+
+        exit(0);
+    }
+
+    /* write the contents of the AppImage to stdout as a tar archive */
+    if(arg && strcmp(arg,"appimage-extract-tar")==0) {
+        char** patterns = NULL;
+        char** pattern_file_patterns = NULL;
+
+        if (isatty(STDOUT_FILENO)) {
+            fprintf(stderr, "Refusing to write archive to a terminal, please redirect stdout\n");
+            exit(1);
+        }
+
+        if (!patterns_from_args(argc, argv, 2, &patterns, &pattern_file_patterns))
+            exit(1);
+
+        if (!extract_appimage_tar(appimage_path, patterns, STDOUT_FILENO))
+            exit(1);
+
+        if (pattern_file_patterns != NULL)
+            free_patterns(pattern_file_patterns);
+
+        exit(0);
+    }
+
+    /* extract the AppImage, and report where the time went */
+    if(arg && strcmp(arg,"appimage-extract-stats")==0) {
+        char** patterns = NULL;
+        char** pattern_file_patterns = NULL;
+
+        if (!patterns_from_args(argc, argv, 2, &patterns, &pattern_file_patterns))
+            exit(1);
+
+        // listing the extracted files would distort the timings
+        struct extract_stats stats;
+        extract_stats_init(&stats);
+        const bool success = extract_appimage(appimage_path, "squashfs-root/", patterns, true, false, &stats);
+
+        print_extract_stats(stderr, &stats);
+        extract_stats_free(&stats);
+
+        if (pattern_file_patterns != NULL)
+            free_patterns(pattern_file_patterns);
+
+        exit(success ? 0 : 1);
+    }
+
     /* extract the AppImage */
     if(arg && strcmp(arg,"appimage-extract")==0) {
-        char* pattern;
+        char** patterns = NULL;
+        char** pattern_file_patterns = NULL;
 
-        // default use case: use standard prefix
-        if (argc == 2) {
-            pattern = NULL;
-        } else if (argc == 3) {
-            pattern = argv[2];
-        } else {
-            fprintf(stderr, "Unexpected argument count: %d\n", argc - 1);
-            fprintf(stderr, "Usage: %s --appimage-extract [<prefix>]\n", argv0_path);
+        // default use case: extract everything
+        if (!patterns_from_args(argc, argv, 2, &patterns, &pattern_file_patterns))
             exit(1);
-        }
 
-        if (!extract_appimage(appimage_path, "squashfs-root/", pattern, true, true)) {
+        if (!extract_appimage(appimage_path, "squashfs-root/", patterns, true, true, NULL)) {
             exit(1);
         }
 
+        if (pattern_file_patterns != NULL)
+            free_patterns(pattern_file_patterns);
+
         exit(0);
     }
 
@@ -688,48 +5168,68 @@ int main(int argc, char *argv[]) {
     if (getenv("APPIMAGE_EXTRACT_AND_RUN") != NULL || (arg && strcmp(arg, "appimage-extract-and-run") == 0)) {
         char* hexlified_digest = NULL;
 
-        // calculate MD5 hash of file, and use it to make extracted directory name "content-aware"
-        // see https://github.com/AppImage/AppImageKit/issues/841 for more information
-        {
-            FILE* f = fopen(appimage_path, "rb");
-            if (f == NULL) {
-                perror("Failed to open AppImage file");
-                exit(EXIT_EXECERROR);
-            }
-
-            Md5Context ctx;
-            Md5Initialise(&ctx);
-
-            char buf[4096];
-            for (size_t bytes_read; (bytes_read = fread(buf, sizeof(char), sizeof(buf), f)); bytes_read > 0) {
-                Md5Update(&ctx, buf, (uint32_t) bytes_read);
-            }
+        // use a key derived from the AppImage to make the extracted directory name "content-aware"
+        phase_start = monotonic_time_ns();
+        hexlified_digest = extract_and_run_cache_key(appimage_path);
+        if (hexlified_digest == NULL) {
+            fprintf(stderr, "Failed to calculate cache key for AppImage\n");
+            exit(EXIT_EXECERROR);
+        }
+        trace_phase("cache_key", phase_start, monotonic_time_ns());
 
-            MD5_HASH digest;
-            Md5Finalise(&ctx, &digest);
+        const bool verbose = (getenv("VERBOSE") != NULL);
+        const bool persistent_cache = persistent_cache_enabled();
 
-            hexlified_digest = appimage_hexlify(digest.bytes, sizeof(digest.bytes));
-        }
+        char* prefix;
+        int cache_entry_lock_fd = -1;
+        char* users_lock_path = NULL;
+        int users_lock_fd = -1;
 
-        char* prefix = malloc(strlen(temp_base) + 20 + strlen(hexlified_digest) + 2);
-        strcpy(prefix, temp_base);
-        strcat(prefix, "/appimage_extracted_");
-        strcat(prefix, hexlified_digest);
-        free(hexlified_digest);
+        phase_start = monotonic_time_ns();
+        if (persistent_cache) {
+            prefix = extract_to_persistent_cache(appimage_path, hexlified_digest, verbose, &cache_entry_lock_fd);
+            free(hexlified_digest);
 
-        const bool verbose = (getenv("VERBOSE") != NULL);
+            if (prefix == NULL) {
+                fprintf(stderr, "Failed to extract AppImage\n");
+                exit(EXIT_EXECERROR);
+            }
+        } else {
+            prefix = malloc(strlen(temp_base) + 20 + strlen(hexlified_digest) + 2);
+            strcpy(prefix, temp_base);
+            strcat(prefix, "/appimage_extracted_");
+            strcat(prefix, hexlified_digest);
+            free(hexlified_digest);
+
+            if (background_cleanup_enabled())
+                reap_stale_trash(temp_base);
+
+            // every instance running from prefix holds a shared lock, the last one to exit cleans up
+            users_lock_path = malloc(strlen(prefix) + 6);
+            sprintf(users_lock_path, "%s.lock", prefix);
+
+            users_lock_fd = lock_file(users_lock_path, LOCK_SH);
+            if (users_lock_fd == -1) {
+                fprintf(stderr, "Failed to lock %s: %s\n", users_lock_path, strerror(errno));
+                exit(EXIT_EXECERROR);
+            }
 
-        if (!extract_appimage(appimage_path, prefix, NULL, false, verbose)) {
-            fprintf(stderr, "Failed to extract AppImage\n");
-            exit(EXIT_EXECERROR);
+            if (!extract_appimage_shared(appimage_path, prefix, verbose)) {
+                fprintf(stderr, "Failed to extract AppImage\n");
+                exit(EXIT_EXECERROR);
+            }
         }
+        trace_phase("extract", phase_start, monotonic_time_ns());
 
         int pid;
+        phase_start = monotonic_time_ns();
         if ((pid = fork()) == -1) {
             int error = errno;
             fprintf(stderr, "fork() failed: %s\n", strerror(error));
             exit(EXIT_EXECERROR);
         } else if (pid == 0) {
+            trace_phase("fork", phase_start, monotonic_time_ns());
+
             const char apprun_fname[] = "AppRun";
             char* apprun_path = malloc(strlen(prefix) + 1 + strlen(apprun_fname) + 1);
             strcpy(apprun_path, prefix);
@@ -754,6 +5254,7 @@ int main(int argc, char *argv[]) {
 
             set_portable_home_and_config(fullpath);
 
+            trace_phase("launch", launch_start, monotonic_time_ns());
             execv(apprun_path, new_argv);
 
             int error = errno;
@@ -767,12 +5268,32 @@ int main(int argc, char *argv[]) {
         int rv = waitpid(pid, &status, 0);
         status = rv > 0 && WIFEXITED (status) ? WEXITSTATUS (status) : EXIT_EXECERROR;
 
-        if (getenv("NO_CLEANUP") == NULL) {
-            if (!rm_recursive(prefix)) {
-                fprintf(stderr, "Failed to clean up cache directory\n");
-                if (status == 0)        /* avoid messing existing failure exit status */
-                  status = EXIT_EXECERROR;
+        // entries in the persistent cache are kept for the next launch
+        if (persistent_cache) {
+            close(cache_entry_lock_fd);
+        } else {
+            // other instances might still be running from the same directory
+            if (getenv("NO_CLEANUP") == NULL && flock(users_lock_fd, LOCK_EX | LOCK_NB) == 0) {
+                char* trash_path = NULL;
+                int trash_fd = background_cleanup_enabled() ? move_to_trash(prefix, &trash_path) : -1;
+
+                if (trash_fd != -1) {
+                    // prefix is gone already, hence the lock can be removed before the actual deletion is done
+                    unlink(users_lock_path);
+                    delete_in_background(&trash_path, &trash_fd, 1);
+                    free(trash_path);
+                } else {
+                    if (!rm_recursive(prefix)) {
+                        fprintf(stderr, "Failed to clean up cache directory\n");
+                        if (status == 0)        /* avoid messing existing failure exit status */
+                          status = EXIT_EXECERROR;
+                    }
+                    unlink(users_lock_path);
+                }
             }
+
+            close(users_lock_fd);
+            free(users_lock_path);
         }
 
         // template == prefix, must be freed only once
@@ -818,32 +5339,70 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
-    LOAD_LIBRARY; /* exit if libfuse is missing */
+    // instances sharing a mount which is already there can skip mounting entirely
+    struct shared_mount shared;
+    bool use_shared_mount = false;
 
-    int dir_fd, res;
+    if (shared_mount_enabled()) {
+        phase_start = monotonic_time_ns();
+        use_shared_mount = shared_mount_open(&shared, appimage_path, temp_base);
+
+        bool stale = false;
+        if (use_shared_mount && shared_mount_is_mounted(&shared, &stale)) {
+            if (!shared_mount_join(&shared))
+                exit(EXIT_EXECERROR);
+            trace_phase("join_shared_mount", phase_start, monotonic_time_ns());
+            run_from_mount_dir(shared.mount_dir, arg, argc, argv, fullpath, argv0_path, launch_start);
+        }
+
+        // the mount lock is held, hence no other instance can be joining or replacing the stale mount
+        if (stale && !shared_mount_unmount_stale(&shared)) {
+            fprintf(stderr, "Shared mount %s is stale, using a private mount\n", shared.mount_dir);
+            flock(shared.lock_fd, LOCK_UN);
+            close(shared.lock_fd);
+            use_shared_mount = false;
+        }
+    }
+
+    phase_start = monotonic_time_ns();
+    LOAD_LIBRARY; /* exit if libfuse is missing */
+    trace_phase("load_library", phase_start, monotonic_time_ns());
 
     size_t templen = strlen(temp_base);
 
     // allocate enough memory (size of name won't exceed 60 bytes)
-    char mount_dir[templen + 60];
+    char private_mount_dir[templen + 60];
+    char* mount_dir = private_mount_dir;
 
-    build_mount_point(mount_dir, argv[0], temp_base, templen);
-
-    size_t mount_dir_size = strlen(mount_dir);
     pid_t pid;
-    char **real_argv;
-    int i;
 
-    if (mkdtemp(mount_dir) == NULL) {
-        perror ("create mount dir error");
-        exit (EXIT_EXECERROR);
+    struct prefetch prefetch;
+    const bool use_prefetch = prefetch_enabled() && prefetch_init(&prefetch, appimage_path);
+
+    phase_start = monotonic_time_ns();
+    if (use_shared_mount) {
+        // the directory is left behind by previous mounts
+        mount_dir = shared.mount_dir;
+        if (mkdir(mount_dir, 0700) == -1 && errno != EEXIST) {
+            perror ("create mount dir error");
+            exit (EXIT_EXECERROR);
+        }
+    } else {
+        build_mount_point(mount_dir, argv[0], temp_base, templen);
+
+        if (mkdtemp(mount_dir) == NULL) {
+            perror ("create mount dir error");
+            exit (EXIT_EXECERROR);
+        }
     }
+    trace_phase("mkdtemp", phase_start, monotonic_time_ns());
 
     if (pipe (keepalive_pipe) == -1) {
         perror ("pipe error");
         exit (EXIT_EXECERROR);
     }
 
+    phase_start = monotonic_time_ns();
     pid = fork ();
     if (pid == -1) {
         perror ("fork error");
@@ -852,24 +5411,41 @@ int main(int argc, char *argv[]) {
 
     if (pid == 0) {
         /* in child */
+        trace_process = "fuse";
+        fuse_start_ns = monotonic_time_ns();
+        trace_phase("fork", phase_start, fuse_start_ns);
+
+        if (use_shared_mount) {
+            // the idle thread locks its own open file description
+            close(shared.lock_fd);
+            fuse_shared_mount = &shared;
+        }
 
-        char *child_argv[5];
+        if (use_prefetch)
+            fuse_prefetch = &prefetch;
+
+        char *child_argv[6];
+        int child_argc = 0;
 
         /* close read pipe */
         close (keepalive_pipe[0]);
 
         char *dir = realpath(appimage_path, NULL );
 
-        char options[100];
-        sprintf(options, "ro,offset=%lu", fs_offset);
+        char options[200];
+        sprintf(options, "ro,offset=%lu," FUSE_CACHE_OPTIONS, fs_offset);
+
+        child_argv[child_argc++] = dir;
+        child_argv[child_argc++] = "-o";
+        child_argv[child_argc++] = options;
+        if (fuse_single_threaded())
+            child_argv[child_argc++] = "-s";
+        child_argv[child_argc++] = dir;
+        child_argv[child_argc++] = mount_dir;
 
-        child_argv[0] = dir;
-        child_argv[1] = "-o";
-        child_argv[2] = options;
-        child_argv[3] = dir;
-        child_argv[4] = mount_dir;
+        if(0 != fusefs_main (child_argc, child_argv, fuse_mounted)){
+            trace_phase("mount_failed", fuse_start_ns, monotonic_time_ns());
 
-        if(0 != fusefs_main (5, child_argv, fuse_mounted)){
             char *title;
             char *body;
             title = "Cannot mount AppImage, please check your FUSE setup.";
@@ -878,80 +5454,38 @@ int main(int argc, char *argv[]) {
             "See https://github.com/AppImage/AppImageKit/wiki/FUSE \n"
             "for more information";
             notify(title, body, 0); // 3 seconds timeout
+        } else if (use_shared_mount) {
+            // unmounted after being idle, the mount lock is still held by the idle thread
+            rmdir(mount_dir);
         };
     } else {
         /* in parent, child is $pid */
         int c;
 
+        trace_phase("fork", phase_start, monotonic_time_ns());
+
         /* close write pipe */
         close (keepalive_pipe[1]);
 
         /* Pause until mounted */
+        phase_start = monotonic_time_ns();
         read (keepalive_pipe[0], &c, 1);
+        trace_phase("wait_for_mount", phase_start, monotonic_time_ns());
 
         /* Fuse process has now daemonized, reap our child */
+        phase_start = monotonic_time_ns();
         waitpid(pid, NULL, 0);
+        trace_phase("reap_fuse_parent", phase_start, monotonic_time_ns());
 
-        dir_fd = open (mount_dir, O_RDONLY);
-        if (dir_fd == -1) {
-            perror ("open dir error");
-            exit (EXIT_EXECERROR);
-        }
-
-        res = dup2 (dir_fd, 1023);
-        if (res == -1) {
-            perror ("dup2 error");
-            exit (EXIT_EXECERROR);
-        }
-        close (dir_fd);
-
-        real_argv = malloc (sizeof (char *) * (argc + 1));
-        for (i = 0; i < argc; i++) {
-            real_argv[i] = argv[i];
-        }
-        real_argv[i] = NULL;
-
-        if(arg && strcmp(arg, "appimage-mount") == 0) {
-            char real_mount_dir[PATH_MAX];
-
-            if (realpath(mount_dir, real_mount_dir) == real_mount_dir) {
-                printf("%s\n", real_mount_dir);
-            } else {
-                printf("%s\n", mount_dir);
-            }
-
-            // stdout is, by default, buffered (unlike stderr), therefore in order to allow other processes to read
-            // the path from stdout, we need to flush the buffers now
-            // this is a less-invasive alternative to setbuf(stdout, NULL);
-            fflush(stdout);
+        if (use_shared_mount) {
+            // the mount does not depend on this instance, it must not hold the pipe open
+            close (keepalive_pipe[0]);
 
-            for (;;) pause();
-
-            exit(0);
-        }
-
-        /* Setting some environment variables that the app "inside" might use */
-        setenv( "APPIMAGE", fullpath, 1 );
-        setenv( "ARGV0", argv0_path, 1 );
-        setenv( "APPDIR", mount_dir, 1 );
-
-        set_portable_home_and_config(fullpath);
-
-        /* Original working directory */
-        char cwd[1024];
-        if (getcwd(cwd, sizeof(cwd)) != NULL) {
-            setenv( "OWD", cwd, 1 );
+            if (!shared_mount_join(&shared))
+                exit(EXIT_EXECERROR);
         }
 
-        char filename[mount_dir_size + 8]; /* enough for mount_dir + "/AppRun" */
-        strcpy (filename, mount_dir);
-        strcat (filename, "/AppRun");
-
-        /* TODO: Find a way to get the exit status and/or output of this */
-        execv (filename, real_argv);
-        /* Error if we continue here */
-        perror("execv error");
-        exit(EXIT_EXECERROR);
+        run_from_mount_dir(mount_dir, arg, argc, argv, fullpath, argv0_path, launch_start);
     }
 
     return 0;